@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Update a CRC32C (Castagnoli) checksum with len bytes of data - start with crc = 0
+// Uses the SSE4.2 crc32 instruction when the CPU supports it and a slicing-by-8 table otherwise
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
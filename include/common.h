@@ -3,6 +3,12 @@
 #include <pthread.h>
 
 #include "queue.h"
+#include "schedule.h"
+#include "watch.h"
+#include "relay.h"
+#include "filter.h"
+#include "manifest.h"
+#include "compress.h"
 
 #define ACK_LEN            8    // length of acknowledgement message
 #define MAX_REPR         100    // no characters to represent a number
@@ -10,6 +16,25 @@
 #define FILE_PERMS      0644    // permissions for a newly created file
 #define BUFFER_SIZE     4096    // buffer size
 #define MAX_CONNECTIONS  100    // max number of connections the server can have opened
+#define MMAP_WINDOW     (64 * 1024 * 1024)  // bytes of a file mapped at once by the mmap sender
+#define DROP_WINDOW     (8 * 1024 * 1024)   // bytes sent before their page cache is released
+#define CHECKSUM_CHUNK  (64 * 1024 * 1024)  // bytes covered by each checksum of a file
+#define MAX_RETRIES        3    // times a segment with a mismatched checksum is sent again
+#define WATCH_DEBOUNCE_MS  200    // quiet time after which the collected changes are streamed
+#define WATCH_MAX_DELAY_MS 2000    // max time changes are held back while events keep arriving
+#define RELAY_POOL_SIZE    4    // workers of a relay serving its clone onward
+#define RELAY_QUEUE_SIZE  16    // queue size of a relay
+#define PREFETCH_DEPTH     4    // default number of upcoming queued files the prefetch thread warms
+#define PREFETCH_BUDGET (64 * 1024 * 1024)  // default bytes the prefetch thread may have warmed at once
+#define POOL_GROW_WAIT_MS   50    // a file that waited longer than this in the queue adds a worker
+#define POOL_IDLE_TIMEOUT_S  5    // a worker idle for this long exits (while the pool exceeds its minimum)
+
+// Session options negotiated during the handshake
+#define OPT_CHECKSUM    0x01    // verify every file (per CHECKSUM_CHUNK segment) with CRC32C
+#define OPT_WATCH       0x02    // after the initial clone keep streaming the changes of the directory
+#define OPT_FDPASS      0x04    // pass open files over a Unix domain socket instead of their content
+#define OPT_MANIFEST    0x08    // send the sorted list of files and directories with their metadata before the files
+#define OPT_COMPRESS    0x10    // send the content as frames, deflated for the files that are worth compressing
 
 
 // Simple struct used to pass information to a communication thread's routine
@@ -19,12 +44,25 @@ typedef struct arg_set {
 } arg_set;
 
 
-// Global variables
-pthread_t* workers;
-Queue queue;
-pthread_mutex_t queue_mutex;
-pthread_cond_t queue_non_empty;
-pthread_cond_t queue_non_full;
+// Global variables (defined in common.c)
+extern Queue queue;
+extern pthread_mutex_t queue_mutex;
+extern pthread_cond_t queue_non_empty;
+extern pthread_cond_t queue_non_full;
+extern int mmap_send;       // if set, workers send file content through mmap instead of read
+extern char* serve_root;    // local directory the requested paths are relative to ("" for the server, results for a relay)
+extern Relay relay;         // clone being received by a relay, NULL for the server
+extern int prefetch_depth;          // number of upcoming queued files to prefetch (0 disables prefetching)
+extern off_t prefetch_budget;       // max bytes warmed by the prefetch thread that have not been sent yet
+extern off_t prefetch_bytes;        // bytes currently warmed and not yet sent
+extern pthread_cond_t queue_prefetch;   // signaled when there may be new work for the prefetch thread
+extern pthread_cond_t prefetch_done;    // signaled when the prefetch thread has finished with a file info
+extern int pool_min;        // workers that are always kept alive
+extern int pool_max;        // workers the pool may grow to under load (0 keeps the pool at its minimum)
+extern int pool_size;       // workers currently alive
+extern int pool_idle;       // workers waiting for the queue to become non-empty
+extern int pool_affinity;   // if set, every worker is pinned to a CPU (round robin)
+extern char* trace_dir;     // directory the sessions' traces are written to, NULL if tracing is off
 
 
 // Print error message and exit process
@@ -42,20 +80,90 @@ int is_file(char* path);
 // Check if a file with the given filepath already exists
 int file_exists(char* filepath);
 
+// Write exactly len bytes to fd, retrying on partial writes
+ssize_t write_all(int fd, const void* buf, size_t len);
+
+// Read exactly len bytes from fd, retrying on partial reads - returns -1 on error or if fd reached its end first
+ssize_t read_all(int fd, void* buf, size_t len);
+
+// Pass the open file descriptor fd over the Unix domain socket (SCM_RIGHTS)
+int send_fd(int socket, int fd);
+
+// Receive an open file descriptor passed over the Unix domain socket, -1 on error
+int receive_fd(int socket);
+
+// Copy len bytes from in_fd to out_fd inside the kernel (reflink if the file system supports it)
+int copy_local(int in_fd, int out_fd, off_t len);
+
 // Recursively create all the directories specified in path
 void recursive_mkdir(const char* dir);
 
-// Count the number of files inside the given directory 
-int count_no_files(char* dirpath);
+// Remove the file or the directory with all its content
+int recursive_remove(const char* path);
+
+// Count the number of files inside the given directory that are not excluded by the filter
+int count_no_files(char* dirpath, Filter filter);
+
+// Add the directory and everything inside it that is not excluded by the filter to the manifest
+// Returns -1 if a directory could not be opened
+int build_manifest(char* dirpath, Filter filter, Manifest manifest);
+
+// Create the queue, the workers thread pool (thread_pool_size workers, growing up to pool_max) and the prefetch thread
+void start_server(int thread_pool_size, int queue_size);
+
+// Start one more worker and print the new pool size with the reason (called with the queue mutex held)
+int add_worker(const char* reason);
+
+// Create a socket listening for connections to the given port
+int create_listener(int port_number);
+
+// Create a Unix domain socket listening for connections at the given path
+int create_unix_listener(const char* path);
 
-// Scan the directory and insert its content into the queue
-void scan_dir(char* dirpath, int fd, int block_size, pthread_mutex_t* client_mutex);
+// Accept connections on the listening socket (arg_set's fd) and create a communication thread for each one
+void* serve(void* args);
 
-// Send the file to the client listening at fd
-void send_file(FileInfo file_info);
+// Communication thread's logic: handshake with the client and insert the requested directory's files into the queue
+void* client_communication(void* args);
 
-// Receive messages from the server (file name, metadata, file content)
-int receive(int socket, char* dirpath, int block_size);
+// End a session: close the client's socket, write the session's trace (in tracing mode) and destroy the session
+void close_session(Session session, int fd);
+
+// Parse the options message sent by the client into OPT_* flags, the session's scheduling policy and its filter rules
+// Returns -1 if an option is not valid
+int parse_options(char* message, Schedule schedule, Filter filter);
+
+// Insert a file into the queue, waiting while the queue is full
+void enqueue_file(char* path, int fd, int block_size, int options, Session session);
+
+// Scan the directory and insert its content that is not excluded by the filter into the queue
+// (or into the schedule, if its policy is not FIFO)
+void scan_dir(char* dirpath, int fd, int block_size, int options, Schedule schedule, Filter filter, Session session);
+
+// Send the file (path, size, content and checksums) to the client listening at fd
+// Returns -1 on error (the client's socket is left open, it is closed by whoever owns the session)
+int transfer_file(FileInfo file_info);
+
+// Send the file and return the number of files that the client reports as remaining, or -1 on error
+int send_file(FileInfo file_info);
+
+// Stream the changes reported by the watcher (except the excluded ones) to the client listening at fd, until the client disconnects
+void stream_changes(Watcher watcher, Filter filter, int fd, int block_size, int options);
+
+// Receive messages from the server (file name, metadata, file content) and return the size of the received file
+off_t receive(int socket, char* dirpath, int block_size, int options);
+
+// Receive the manifest, create the directories it lists and preallocate its files inside dirpath
+Manifest receive_manifest(int socket, char* dirpath);
+
+// Apply the modes and modification times of the manifest to the clone inside dirpath
+void apply_metadata(Manifest manifest, char* dirpath);
+
+// Receive the changes streamed by the server and apply them, until the server disconnects
+void receive_changes(int socket, char* dirpath, int block_size, int options);
 
 // Worker's logic
-void* process(void* args);
\ No newline at end of file
+void* process(void* args);
+
+// Prefetch thread's logic: open, stat and read ahead the next queued files
+void* prefetch(void* args);
\ No newline at end of file
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#define COMPRESS_LEVEL          1   // zlib level: the fastest one, source trees still shrink several times
+#define COMPRESS_MIN_SIZE     512   // smaller files are sent stored (the frames would not pay off)
+#define COMPRESS_SAMPLE (64 * 1024) // bytes at the start of a file that are compressed to probe its ratio
+#define COMPRESS_MAX_RATIO    0.9   // a file whose sample does not shrink below this ratio is sent stored
+
+// Header of a frame of content, both lengths in network byte order
+// A stored frame (comp_len 0) is followed by raw_len raw bytes, any other frame by comp_len bytes
+// of the segment's deflate stream that inflate to raw_len bytes
+struct frame_header {
+    uint32_t raw_len;
+    uint32_t comp_len;
+};
+
+// Deflate stream of a worker's transfer, flushed at every block so that each frame can be inflated on arrival
+struct compressor {
+    z_stream stream;
+    unsigned char* out;         // frame of the last block: room for its header followed by the compressed bytes
+    size_t out_size;
+};
+typedef struct compressor* Compressor;
+
+struct decompressor {
+    z_stream stream;
+    unsigned char* in;          // compressed bytes of the frame being inflated (at most in_size)
+    size_t in_size;
+};
+typedef struct decompressor* Decompressor;
+
+
+// Create a compressor for blocks of up to block_size bytes
+Compressor create_compressor(int block_size);
+
+// Decide whether the file is worth compressing: not a known compressed format (by extension),
+// not too small and its first COMPRESS_SAMPLE bytes shrink below COMPRESS_MAX_RATIO
+int compress_worth(Compressor compressor, int fd, const char* path, off_t size);
+
+// Start a new deflate stream (at the start of every segment, so that a segment can be sent again)
+void compressor_reset(Compressor compressor);
+
+// Compress len bytes into compressor->out (after the frame's header) and flush them,
+// returns the compressed length or -1 on error
+ssize_t compress_block(Compressor compressor, const void* data, size_t len);
+
+// Destroy the compressor
+void destroy_compressor(Compressor compressor);
+
+// Create a decompressor for frames of up to block_size raw bytes (a deflated block never exceeds in_size bytes)
+Decompressor create_decompressor(int block_size);
+
+// Start a new inflate stream (at the start of every segment)
+void decompressor_reset(Decompressor decompressor);
+
+// Inflate the comp_len bytes in decompressor->in into exactly raw_len bytes of out
+// Returns -1 if they are not a valid part of the stream or do not inflate to raw_len bytes
+int decompress_block(Decompressor decompressor, size_t comp_len, void* out, size_t raw_len);
+
+// Destroy the decompressor
+void destroy_decompressor(Decompressor decompressor);
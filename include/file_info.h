@@ -1,15 +1,29 @@
 #pragma once
 
 #include <pthread.h> 
+#include <sys/types.h>
+#include <time.h>
+
+#include "session.h"
+
+// States of a file info with regard to the prefetch thread
+#define PREFETCH_NONE   0   // not touched by the prefetch thread
+#define PREFETCH_BUSY   1   // being opened and warmed by the prefetch thread
+#define PREFETCH_DONE   2   // opened (read_fd) and warmed (warmed bytes)
 
 struct file_info {
     int socket_fd;
     int block_size;
+    int options;            // OPT_* flags negotiated with the client
     char* filepath;
-    pthread_mutex_t* mutex;
+    Session session;        // client the file is sent to
+    int prefetch_state;
+    int read_fd;            // file descriptor opened by the prefetch thread or -1
+    off_t warmed;           // bytes of the file that were requested to be read ahead
+    struct timespec queued; // time the file was inserted into the queue (CLOCK_MONOTONIC)
 };
 typedef struct file_info* FileInfo;
 
-FileInfo create_file_info(int fd, int bs, char* file_path, pthread_mutex_t* client_mutex);
+FileInfo create_file_info(int fd, int bs, int options, char* file_path, Session session);
 
 void destroy_file_info(FileInfo file_info);
\ No newline at end of file
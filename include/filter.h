@@ -0,0 +1,72 @@
+#pragma once
+
+// Types of entries a rule applies to (a pattern ending in '/' only applies to directories)
+#define FILTER_FILE     0x01
+#define FILTER_DIR      0x02
+
+// Node of a trie of literal patterns (children are kept in a sibling list)
+struct trie_node {
+    char c;
+    unsigned char exact;        // types of the patterns that end at this node
+    unsigned char prefix;       // types of the "<literal>*" patterns that end at this node
+    struct trie_node* child;
+    struct trie_node* sibling;
+};
+
+// Element of a compiled glob: a character, '?', '*' or a [...] class
+struct glob_token {
+    char type;
+    char c;
+    unsigned char* set;         // 256 entries, only for a class
+};
+
+// Pattern with wildcards anywhere, matched by simulating the automaton of its tokens
+struct glob {
+    struct glob_token* tokens;
+    int no_tokens;
+    int path;                   // matched against the relative path, otherwise against the base name
+    unsigned char types;
+};
+
+// Compiled include or exclude rules
+struct rules {
+    int count;
+    struct trie_node* names;    // literal and "<literal>*" patterns matched against the base name
+    struct trie_node* paths;    // literal and "<literal>*" patterns matched against the relative path
+    struct trie_node* suffixes; // "*<literal>" patterns (reversed) matched against the end of the base name
+    struct glob* globs;         // every other pattern
+    int no_globs;
+};
+
+struct filter {
+    char* root;                 // filtered directory, paths are matched relative to it
+    struct rules include;
+    struct rules exclude;
+    char* parent;               // directory of the last file checked against the include rules (files are checked
+    size_t parent_len;          // one directory at a time) and whether it or one of its own parents is included
+    int parent_included;
+};
+typedef struct filter* Filter;
+
+
+// Create a filter without rules (nothing is excluded) for the files of the given directory
+Filter create_filter(const char* root);
+
+// Add an include or exclude glob: a pattern without '/' matches the base name at any depth,
+// otherwise the path relative to the root ('*', '?' and [...] never match '/')
+// Returns -1 if the pattern is not valid
+int filter_add(Filter filter, int exclude, const char* pattern);
+
+// Check if the filter has any rules
+int filter_active(Filter filter);
+
+// Check if the file or directory (whose parents are known not to be excluded) is excluded:
+// an excluded directory is pruned, a file is excluded if it matches an exclude rule or, when there are include rules,
+// neither it nor one of its parent directories matches an include rule
+int filter_excluded(Filter filter, const char* path, int is_dir);
+
+// Check if the file or directory is excluded, itself or through one of its parent directories
+int filter_path_excluded(Filter filter, const char* path, int is_dir);
+
+// Destroy the filter
+void destroy_filter(Filter filter);
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Types of manifest entries
+#define ENTRY_FILE  'f'
+#define ENTRY_DIR   'd'
+
+struct manifest_entry {
+    char type;
+    mode_t mode;                // permission bits
+    off_t size;                 // 0 for a directory
+    struct timespec mtime;
+    char* path;                 // path as it is sent to the client (relative to the served root)
+};
+
+struct manifest {
+    struct manifest_entry* entries;
+    int count;
+    int capacity;
+    int no_files;               // regular files among the entries
+    off_t total_bytes;          // sum of the sizes of the regular files
+};
+typedef struct manifest* Manifest;
+
+
+// Create an empty manifest
+Manifest create_manifest(void);
+
+// Add a file or directory with the metadata of its stat
+void manifest_add(Manifest manifest, char type, const char* path, const struct stat* s);
+
+// Sort the entries by path (a directory comes before its content)
+void manifest_sort(Manifest manifest);
+
+// Encode the manifest into a newly allocated blob of len bytes:
+// one "<type> <mode> <size> <mtime sec>.<mtime nsec> <path>\0" record per entry
+char* manifest_encode(Manifest manifest, size_t* len);
+
+// Decode a blob created by manifest_encode, returns NULL if it is malformed
+Manifest manifest_decode(const char* blob, size_t len);
+
+// Destroy the manifest
+void destroy_manifest(Manifest manifest);
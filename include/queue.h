@@ -6,6 +6,7 @@ struct queue {
     FileInfo* data;
     int size;
     int free_slots;
+    int head;           // position of the oldest file info
 };
 typedef struct queue* Queue;
 
@@ -13,11 +14,14 @@ typedef struct queue* Queue;
 // Create a queue
 Queue create_queue(int size);
 
-// Insert the given file info into the first empty position of the queue
+// Insert the given file info at the back of the queue
 void insert_file_info(Queue queue, FileInfo file_info);
 
-// Get the value of the queue's first nonempty position
-FileInfo get_first(Queue queue);
+// Remove and return the k-th file info from the front of the queue (the ones before it keep their order), or NULL
+FileInfo remove_file_info(Queue queue, int k);
+
+// Return the k-th file info from the front of the queue without removing it, or NULL
+FileInfo peek_file_info(Queue queue, int k);
 
 // Destroy the queue
 void destroy_queue(Queue queue);
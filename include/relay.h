@@ -0,0 +1,33 @@
+#pragma once
+
+#include <pthread.h>
+
+// Files of a clone that is still being received, so that a relay can serve them onward as soon as they land
+struct relay {
+    pthread_mutex_t mutex;
+    pthread_cond_t landed;      // broadcast whenever a file lands or the clone completes
+    char* dir;                  // directory requested from the upstream server
+    char** files;               // local paths of the files that have landed, in landing order
+    int count;
+    int capacity;
+    int total;                  // number of files the upstream server is going to send
+    int complete;               // set once every file has landed
+};
+typedef struct relay* Relay;
+
+
+// Create a relay for the clone of dir, which consists of total files
+Relay create_relay(const char* dir, int total);
+
+// Record a file that has been received completely
+void relay_landed(Relay relay, const char* path);
+
+// Record that the clone has been completed
+void relay_complete(Relay relay);
+
+// Decide how a downstream request for dir is served: returns 1 if its files should be streamed as they land,
+// otherwise waits until the clone has been completed and returns 0 (the local copy can then be served as is)
+int relay_attach(Relay relay, const char* dir, int can_stream);
+
+// Wait until the i-th file has landed and return its local path
+char* relay_next(Relay relay, int i);
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <sys/types.h>
+
+// Scheduling policies: the order in which the files of a session are inserted into the queue
+#define POLICY_FIFO         0   // directory order, files are inserted while the directory is scanned
+#define POLICY_SMALLEST     1   // smallest files first
+#define POLICY_LARGEST      2   // largest files first (avoids a big straggler at the end)
+#define POLICY_PRIORITY     3   // files matching earlier patterns first, the rest in directory order
+
+struct schedule_entry {
+    char* path;
+    off_t size;
+    int rank;           // index of the first matching priority pattern
+    int seq;            // position in directory order, keeps the sort stable
+};
+
+struct schedule {
+    char* root;         // scanned directory, patterns are matched against paths relative to it
+    int policy;
+    char** patterns;
+    int no_patterns;
+    struct schedule_entry* entries;
+    int count;
+    int capacity;
+};
+typedef struct schedule* Schedule;
+
+
+// Create an empty FIFO schedule for the files of the given directory
+Schedule create_schedule(const char* root);
+
+// Set the policy from its description: fifo, smallest, largest or priority:<pattern>[,<pattern>...]
+// Returns -1 if the description is not valid
+int set_policy(Schedule schedule, const char* description);
+
+// Add a file of the given size
+void schedule_add(Schedule schedule, const char* path, off_t size);
+
+// Sort the added files according to the policy
+void schedule_sort(Schedule schedule);
+
+// Destroy the schedule
+void destroy_schedule(Schedule schedule);
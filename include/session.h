@@ -0,0 +1,38 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "trace.h"
+
+struct session {
+    pthread_mutex_t refs_mutex; // guards refs and failed, only held briefly (never during a transfer)
+    pthread_cond_t synced;      // signaled (with refs_mutex) whenever a worker has released one of the session's files
+    int refs;                   // queued files not yet released by a worker, plus one for the communication thread
+    int failed;                 // set once a transfer has failed, the remaining files are released without being sent
+    int busy;                   // a worker is handling one of the session's files (guarded by queue_mutex): only one
+                                // worker at a time sends to the client, and its files are taken in queue order
+    Trace trace;                // spans of the session's stages, NULL if tracing is off
+};
+typedef struct session* Session;
+
+// Create a session referenced by the communication thread only
+Session create_session(void);
+
+// Add a reference for a file that is about to be queued, returns -1 (and adds none) if the session has failed
+int retain_session(Session session);
+
+// Drop a reference, returns 1 if it was the last one: the caller then closes the client's socket and destroys the session
+int release_session(Session session);
+
+// Mark the session as failed: its remaining files are released without being sent
+void fail_session(Session session);
+
+// Return whether a transfer of the session has failed
+int session_failed(Session session);
+
+// Wait until the workers have released every queued file (only the communication thread's reference is left),
+// returns whether a transfer has failed
+int sync_session(Session session);
+
+// Destroy the session and its trace
+void destroy_session(Session session);
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <time.h>
+
+#define TRACE_SPANS     65536   // spans recorded per session, later ones are dropped
+#define TRACE_DETAIL       64   // characters of a span's detail (the end of a path) that are kept
+
+struct trace_span {
+    const char* name;           // stage (a string literal)
+    int tid;                    // thread that recorded the span
+    long long start;            // microseconds (CLOCK_MONOTONIC)
+    long long duration;
+    char detail[TRACE_DETAIL];
+};
+
+// Spans of a session, recorded by many threads without a lock: every span claims its slot with an atomic increment
+struct trace {
+    char* path;                 // file the trace is written to
+    struct trace_span* spans;
+    atomic_int count;           // slots claimed so far (may exceed TRACE_SPANS)
+};
+typedef struct trace* Trace;
+
+
+// Create an empty trace that is going to be written to the given file
+Trace create_trace(const char* path);
+
+// Current time in microseconds (CLOCK_MONOTONIC)
+long long trace_now(void);
+
+// Convert a CLOCK_MONOTONIC time to microseconds
+long long trace_time(const struct timespec* time);
+
+// Record a span of the stage from start to end (does nothing if trace is NULL)
+void trace_span(Trace trace, const char* name, const char* detail, long long start, long long end);
+
+// Write the trace as Chrome trace-event JSON (viewable in chrome://tracing or Perfetto)
+// Returns -1 if the file could not be written
+int write_trace(Trace trace);
+
+// Destroy the trace (without writing it)
+void destroy_trace(Trace trace);
@@ -0,0 +1,40 @@
+#pragma once
+
+// Types of changes reported by a watcher
+#define CHANGE_MODIFIED     0   // a file was created or modified
+#define CHANGE_DELETED      1   // a file or directory was deleted (or moved out of the tree)
+#define CHANGE_RENAMED      2   // a file or directory was renamed inside the tree
+
+struct change {
+    int type;
+    char* path;
+    char* new_path;     // only for CHANGE_RENAMED
+};
+
+struct watcher {
+    char* root;                 // watched directory
+    int fd;                     // inotify file descriptor
+    int* wds;                   // watch descriptors ...
+    char** dirs;                // ... and the directories they watch
+    int no_watches;
+    int watch_capacity;
+    struct change* changes;     // coalesced changes in the order they should be applied
+    int no_changes;
+    int change_capacity;
+};
+typedef struct watcher* Watcher;
+
+
+// Create a watcher that recursively watches the given directory, NULL on failure
+Watcher create_watcher(const char* root);
+
+// Wait for changes and collect them until no new event arrives for debounce_ms (or max_delay_ms have passed)
+// Changes to the same path are coalesced, so only the last state of each path is reported
+// Returns the number of collected changes or -1 on error
+int collect_changes(Watcher watcher, int debounce_ms, int max_delay_ms);
+
+// Forget the collected changes
+void clear_changes(Watcher watcher);
+
+// Destroy the watcher
+void destroy_watcher(Watcher watcher);
@@ -8,48 +8,136 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <pthread.h>
 #include <arpa/inet.h>
 #include <libgen.h>
+#include <time.h>
 
 #include "common.h"
 
 
-int main(int argc, char* argv[]) {
-    if (argc != 7) {
-        fprintf(stderr, "Usage: -i <server_ip> -p <server_port> -d <directory>\n");
-        exit(EXIT_FAILURE);
+// Compare two completion times (used to sort them)
+static int compare_times(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// Print the distribution of the per-file completion times (seconds since the transfer started)
+static void report_completion_times(double* times, int count, const char* policy) {
+    if (count == 0) {
+        return;
+    }
+    double sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += times[i];
     }
+    qsort(times, count, sizeof(double), compare_times);
+    printf("Completion times (policy %s, %d files): mean %.3fs, p50 %.3fs, p90 %.3fs, p99 %.3fs, max %.3fs\n",
+           policy, count, sum / count, times[count / 2], times[(int) (count * 0.9)], times[(int) (count * 0.99)], times[count - 1]);
+}
+
+
+// Print how many files and bytes have been received, the throughput and the estimated time left
+static void report_progress(int files, int total_files, off_t bytes, off_t total_bytes, double elapsed) {
+    double rate = (elapsed > 0) ? bytes / elapsed : 0;
+    double percent = total_bytes ? 100.0 * bytes / total_bytes : 100.0;
+    printf("Progress: %d/%d files, %.1f/%.1f MB (%.1f%%), %.1f MB/s", files, total_files, bytes / 1e6, total_bytes / 1e6, percent, rate / 1e6);
+    if (rate > 0 && bytes < total_bytes) {
+        printf(", ETA %.1fs", (total_bytes - bytes) / rate);
+    }
+    printf("\n");
+}
+
+
+// Print the usage and exit
+static void usage(void) {
+    fprintf(stderr, "Usage: -i <server_ip | unix:socket_path> [-p <server_port>] -d <directory> [-c] [-z] [-w] [-M] [-P <policy>] [-I <include_glob>]... [-E <exclude_glob>]... [-o <results_dir>] [-r <relay_port>]\n");
+    exit(EXIT_FAILURE);
+}
+
+// Return the value of the i-th argument (a flag), advancing i - exits with the usage if it is missing
+static char* flag_value(int argc, char* argv[], int* i) {
+    if (*i + 1 >= argc) {
+        usage();
+    }
+    return argv[++*i];
+}
+
+
+int main(int argc, char* argv[]) {
 
-    int server_port = 0;
-    char* server_ip, * directory;
+    int server_port = 0, relay_port = 0;
+    int options = 0;
+    char* server_ip, * directory, * policy, * results;
     server_ip = directory = NULL;
+    policy = "fifo";
+    results = "results";
+
+    // Include and exclude globs, sent to the server as "include=<glob>" and "exclude=<glob>" options
+    char** rules = malloc(sizeof(char*) * argc);
+    int no_rules = 0;
 
     // Parse arguments
     int i;
     for (i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "-i")) {
-            server_ip = argv[++i];
+            server_ip = flag_value(argc, argv, &i);
         }
         else if (!strcmp(argv[i], "-p")) {
-            server_port = atoi(argv[++i]);
+            server_port = atoi(flag_value(argc, argv, &i));
         }
         else if (!strcmp(argv[i], "-d")) {
-            directory = argv[++i];
+            directory = flag_value(argc, argv, &i);
             if (directory[0] != '/' || strlen(directory) == 1) {
                 fprintf(stderr, "Directory must begin with '/' and have length > 1\n");
                 exit(EXIT_FAILURE);
             }
         }
+        else if (!strcmp(argv[i], "-c")) {
+            options |= OPT_CHECKSUM;
+        }
+        else if (!strcmp(argv[i], "-z")) {
+            options |= OPT_COMPRESS;
+        }
+        else if (!strcmp(argv[i], "-w")) {
+            options |= OPT_WATCH;
+        }
+        else if (!strcmp(argv[i], "-M")) {
+            options |= OPT_MANIFEST;
+        }
+        else if (!strcmp(argv[i], "-P")) {
+            policy = flag_value(argc, argv, &i);
+        }
+        else if (!strcmp(argv[i], "-I") || !strcmp(argv[i], "-E")) {
+            const char* kind = strcmp(argv[i], "-I") ? "exclude" : "include";
+            char* glob = flag_value(argc, argv, &i);
+            rules[no_rules] = malloc(strlen(kind) + strlen(glob) + 2);
+            sprintf(rules[no_rules++], "%s=%s", kind, glob);
+        }
+        else if (!strcmp(argv[i], "-o")) {
+            results = flag_value(argc, argv, &i);
+        }
+        else if (!strcmp(argv[i], "-r")) {
+            relay_port = atoi(flag_value(argc, argv, &i));
+        }
         else {
-            fprintf(stderr, "Usage: -i <server_ip> -p <server_port> -d <directory>\n");
-            exit(EXIT_FAILURE);
+            usage();
         }
     }
 
-    if (!server_ip || !server_port || !directory) {
+    // A unix: target is a server on the same host, which passes open files instead of their content
+    // (so there is nothing to compress)
+    int local = server_ip && !strncmp(server_ip, "unix:", strlen("unix:"));
+    if (local) {
+        options |= OPT_FDPASS;
+        options &= ~OPT_COMPRESS;
+    }
+
+    if (!server_ip || (!server_port && !local) || !directory) {
         fprintf(stderr, "All arguments must be initialized\n");
         exit(EXIT_FAILURE);
     }
@@ -58,23 +146,43 @@ int main(int argc, char* argv[]) {
     char buffer[BUFFER_SIZE];
     memset(buffer, 0, BUFFER_SIZE);
 
-    // Create socket
+    // Create socket and initiate connection
     int sock;
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror_exit("main: socket");
+    if (local) {
+        struct sockaddr_un server;
+        memset(&server, 0, sizeof(server));
+        server.sun_family = AF_UNIX;
+        strncpy(server.sun_path, server_ip + strlen("unix:"), sizeof(server.sun_path) - 1);
+        if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            perror_exit("main: socket");
+        }
+        if (connect(sock, (struct sockaddr*) &server, sizeof(server)) < 0) {
+            perror_exit("main: connect");
+        }
+        printf("\nConnecting to %s\n", server.sun_path);
     }
+    else {
+        if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            perror_exit("main: socket");
+        }
+
+        // Initialize server sockaddr_in struct
+        struct sockaddr_in server;
+        server.sin_family = AF_INET;
+        server.sin_addr.s_addr = inet_addr(server_ip);
+        server.sin_port = htons(server_port);
 
-    // Initialize server sockaddr_in struct
-    struct sockaddr_in server;
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = inet_addr(server_ip);
-    server.sin_port = htons(server_port);
+        // Disable Nagle's algorithm, acknowledgements must reach the server immediately
+        int nodelay = 1;
+        if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*) &nodelay, sizeof(nodelay)) < 0) {
+            perror_exit("main: setsockopt");
+        }
 
-    // Initiate connection
-    if (connect(sock, (struct sockaddr*) &server, sizeof(server)) < 0) {
-        perror_exit("main: connect");
+        if (connect(sock, (struct sockaddr*) &server, sizeof(server)) < 0) {
+            perror_exit("main: connect");
+        }
+        printf("\nConnecting to %s port %d\n", server_ip, server_port);
     }
-    printf("\nConnecting to %s port %d\n", server_ip, server_port);
 
     // Send dir to clone
     ssize_t bytes;
@@ -83,6 +191,47 @@ int main(int argc, char* argv[]) {
         perror_exit("main: write");
     }
 
+    // Wait for response and send the session options (one per line)
+    bytes = read(sock, buffer, ACK_LEN);
+    if (bytes == -1) {
+        perror_exit("main: read");
+    }
+    if (strcmp(buffer, "DP READ")) {
+        fprintf(stderr, "Error during server-client communication\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(buffer, 0, BUFFER_SIZE);
+    if (options & OPT_CHECKSUM) {
+        strcat(buffer, "checksum\n");
+    }
+    if (options & OPT_WATCH) {
+        strcat(buffer, "watch\n");
+    }
+    if (options & OPT_FDPASS) {
+        strcat(buffer, "fdpass\n");
+    }
+    if (options & OPT_MANIFEST) {
+        strcat(buffer, "manifest\n");
+    }
+    if (options & OPT_COMPRESS) {
+        strcat(buffer, "compress\n");
+    }
+    snprintf(buffer + strlen(buffer), BUFFER_SIZE - strlen(buffer), "policy=%s\n", policy);
+    for (i = 0; i < no_rules; i++) {
+        if (strlen(buffer) + strlen(rules[i]) + 2 > BUFFER_SIZE) {
+            fprintf(stderr, "Too many include/exclude rules\n");
+            exit(EXIT_FAILURE);
+        }
+        strcat(buffer, rules[i]);
+        strcat(buffer, "\n");
+        free(rules[i]);
+    }
+    free(rules);
+    bytes = write(sock, buffer, strlen(buffer) + 1);
+    if (bytes == -1) {
+        perror_exit("main: write");
+    }
+
     // Read number of files that reside in the directory and make sure the the dir given is valid
     int no_files;
     memset(buffer, 0, BUFFER_SIZE);
@@ -90,7 +239,11 @@ int main(int argc, char* argv[]) {
     if (bytes == -1) {
         perror_exit("main: read");
     }
-    if (!strcmp(buffer, "INVALID DIR")) {
+    if (!strcmp(buffer, "INVALID OPTIONS")) {
+        fprintf(stderr, "Invalid options (unknown scheduling policy or invalid include/exclude glob?)\n");
+        exit(EXIT_FAILURE);
+    }
+    else if (!strcmp(buffer, "INVALID DIR")) {
         fprintf(stderr, "Invalid directory\n");
         exit(EXIT_FAILURE);
     }
@@ -98,12 +251,16 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "Server had no permissions to open the specified directory or a directory that resides inside it\n");
         exit(EXIT_FAILURE);
     }
+    else if (!strcmp(buffer, "COULD NOT WATCH DIR")) {
+        fprintf(stderr, "Server could not watch the specified directory for changes\n");
+        exit(EXIT_FAILURE);
+    }
     no_files = atoi(buffer);
     printf("Number of files inside %s: %d\n", directory, no_files); // includes nested directories
 
     // Create dir clone in results, only if dir was valid
     memset(buffer, 0, BUFFER_SIZE);
-    strcat(buffer, "results");
+    strcat(buffer, results);
     strcat(buffer, directory);
     recursive_mkdir(buffer);
 
@@ -133,11 +290,47 @@ int main(int argc, char* argv[]) {
         perror_exit("main: write");
     }
 
+    // With a manifest, create the directories and preallocate the files before any content arrives
+    Manifest manifest = NULL;
+    if (options & OPT_MANIFEST) {
+        manifest = receive_manifest(sock, results);
+    }
+
+    // In relay mode serve the clone onward - its files are streamed to downstream clients as soon as they land
+    pthread_t relay_thread;
+    arg_set relay_args;
+    if (relay_port > 0) {
+        signal(SIGPIPE, SIG_IGN);
+        serve_root = results;
+        relay = create_relay(directory, no_files);
+        start_server(RELAY_POOL_SIZE, RELAY_QUEUE_SIZE);
+        relay_args.fd = create_listener(relay_port);
+        relay_args.block_size = block_size;
+        if (pthread_create(&relay_thread, NULL, serve, (void*) &relay_args)) {
+            fprintf(stderr, "main: pthread_create\n");
+            exit(EXIT_FAILURE);
+        }
+        printf("Relaying %s on port %d\n", directory, relay_port);
+    }
+
     // While the task has not been completed
+    int total_files = no_files;
+    double* completion_times = malloc(sizeof(double) * (total_files + 1));
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    off_t received = 0;
     while (no_files > 0) {
-        // Receive a file
-        receive(sock, "results", block_size);
+        // Receive a file and record when it became usable
+        received += receive(sock, results, block_size, options);
         no_files--;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+        completion_times[total_files - no_files - 1] = elapsed;
+
+        // The manifest's total makes the progress byte-accurate
+        if (manifest) {
+            report_progress(total_files - no_files, total_files, received, manifest->total_bytes, elapsed);
+        }
 
         // Inform the server how many files remain to be received
         memset(buffer, 0, BUFFER_SIZE);
@@ -148,10 +341,32 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    // Apply the modes and modification times once every file has been written
+    if (manifest) {
+        apply_metadata(manifest, results);
+        destroy_manifest(manifest);
+    }
+
+    if (relay) {
+        relay_complete(relay);
+    }
     if (!no_files) {
-        printf("Directory %s has been successfully cloned in results.\n", directory);
+        printf("Directory %s has been successfully cloned in %s.\n", directory, results);
+        report_completion_times(completion_times, total_files, policy);
     }
+    free(completion_times);
 
+    // In watch mode keep applying the changes the server streams
+    if (options & OPT_WATCH) {
+        printf("Watching %s for changes...\n", directory);
+        receive_changes(sock, results, block_size, options);
+        printf("Server stopped watching %s\n", directory);
+    }
     close(sock);
+
+    // A relay keeps serving its clone
+    if (relay) {
+        pthread_join(relay_thread, NULL);
+    }
     exit(EXIT_SUCCESS);
 }
@@ -11,15 +11,52 @@
 #include <dirent.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <ctype.h>
 #include <arpa/inet.h>
 #include <libgen.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <ftw.h>
+#include <sched.h>
+#include <time.h>
+#include <setjmp.h>
+#include <signal.h>
 
 #include "common.h"
+#include "checksum.h"
 
 extern int errno;
 
 
+// Global variables
+Queue queue;
+pthread_mutex_t queue_mutex;
+pthread_cond_t queue_non_empty;
+pthread_cond_t queue_non_full;
+int mmap_send = 0;
+char* serve_root = "";
+Relay relay = NULL;
+int prefetch_depth = PREFETCH_DEPTH;
+off_t prefetch_budget = PREFETCH_BUDGET;
+off_t prefetch_bytes = 0;
+pthread_cond_t queue_prefetch;
+pthread_cond_t prefetch_done;
+int pool_min = 0;
+int pool_max = 0;
+int pool_size = 0;
+int pool_idle = 0;
+int pool_affinity = 0;
+char* trace_dir = NULL;
+static atomic_int trace_sessions;
+static struct timespec pool_start;
+static int pool_next_cpu = 0;
+static cpu_set_t pool_cpus;             // CPUs the process may run on (its affinity mask when the server started)
+
+
 /////////////////////////////////////////////// Error related ///////////////////////////////////////////////
 
 void perror_exit(const char* message) {
@@ -33,6 +70,106 @@ void perror_thr(const char* message, long thread_id) {
 }
 
 
+/////////////////////////////////////////////// I/O related ///////////////////////////////////////////////
+
+ssize_t write_all(int fd, const void* buf, size_t len) {
+    const char* p = buf;
+    size_t left = len;
+    while (left > 0) {
+        ssize_t bytes = write(fd, p, left);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += bytes;
+        left -= bytes;
+    }
+    return len;
+}
+
+ssize_t read_all(int fd, void* buf, size_t len) {
+    char* p = buf;
+    size_t left = len;
+    while (left > 0) {
+        ssize_t bytes = read(fd, p, left);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        else if (bytes == 0) {
+            return -1;
+        }
+        p += bytes;
+        left -= bytes;
+    }
+    return len;
+}
+
+int send_fd(int socket, int fd) {
+    char data = 'F';
+    struct iovec iov = { .iov_base = &data, .iov_len = 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return (sendmsg(socket, &msg, 0) == 1) ? 0 : -1;
+}
+
+int receive_fd(int socket) {
+    char data;
+    struct iovec iov = { .iov_base = &data, .iov_len = 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    if (recvmsg(socket, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        return -1;
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+int copy_local(int in_fd, int out_fd, off_t len) {
+    // Share the extents if the file system supports reflinks (btrfs, xfs)
+    if (len > 0 && ioctl(out_fd, FICLONE, in_fd) == 0) {
+        return 0;
+    }
+
+    // Otherwise copy inside the kernel, and fall back to a read/write loop if that is not supported
+    off_t in_off = 0, out_off = 0;
+    while (in_off < len) {
+        ssize_t bytes = copy_file_range(in_fd, &in_off, out_fd, &out_off, len - in_off, 0);
+        if (bytes == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+            break;
+        }
+        else if (bytes <= 0) {
+            return -1;
+        }
+    }
+    char buffer[BUFFER_SIZE];
+    while (in_off < len) {
+        ssize_t bytes = pread(in_fd, buffer, BUFFER_SIZE, in_off);
+        if (bytes <= 0 || pwrite(out_fd, buffer, bytes, out_off) != bytes) {
+            return -1;
+        }
+        in_off += bytes;
+        out_off += bytes;
+    }
+    return 0;
+}
+
+
 /////////////////////////////////////////////// Dir - File related ///////////////////////////////////////////////
 
 int is_dir(char* path) {
@@ -80,50 +217,175 @@ void recursive_mkdir(const char* dir) {
 }
 
 
+// nftw callback of recursive_remove
+static int remove_entry(const char* path, const struct stat* s, int flag, struct FTW* ftw) {
+    return remove(path);
+}
+
+int recursive_remove(const char* path) {
+    return nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
 
 /////////////////////////////////////////////// Server related ///////////////////////////////////////////////
 
-int count_no_files(char* dirpath) {
+int count_no_files(char* dirpath, Filter filter) {
     DIR* dir = opendir(dirpath);
     if (!dir) {
         return -1;   // if we could not open even 1 dir - nested or not - we want the process to fail
     }
     int count = 0;
-    char* new_path;
     struct dirent* dp;
     while ((dp = readdir(dir))) {
         if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0) {
             continue;
         }
-        switch (dp->d_type) {
-        case DT_REG:
+        if (dp->d_type != DT_REG && dp->d_type != DT_DIR) {
+            continue;
+        }
+        char* new_path = malloc(strlen(dirpath) + strlen(dp->d_name) + 2);
+        sprintf(new_path, "%s/%s", dirpath, dp->d_name);
+
+        // Excluded directories are pruned without being opened
+        if (filter_excluded(filter, new_path, dp->d_type == DT_DIR)) {
+            free(new_path);
+            continue;
+        }
+        if (dp->d_type == DT_REG) {
             ++count;
-            break;
-        case DT_DIR:
-            new_path = malloc(strlen(dirpath) + strlen(dp->d_name) + 2);
-            sprintf(new_path, "%s/%s", dirpath, dp->d_name);
-            int t = count_no_files(new_path);
+        }
+        else {
+            int t = count_no_files(new_path, filter);
             if (t < 0) {
                 count = t;
                 return count;
             }
             count += t;
-            free(new_path);
-            new_path = NULL;
-            break;
-        default:
-            continue;
         }
+        free(new_path);
     }
     closedir(dir);
     return count;
 }
 
-void scan_dir(char* dirpath, int fd, int block_size, pthread_mutex_t* client_mutex) {
+int build_manifest(char* dirpath, Filter filter, Manifest manifest) {
+    DIR* dir = opendir(dirpath);
+    struct stat s;
+    if (!dir || stat(dirpath, &s) == -1) {
+        if (dir) {
+            closedir(dir);
+        }
+        return -1;
+    }
+    manifest_add(manifest, ENTRY_DIR, dirpath + strlen(serve_root), &s);
+    char path[BUFFER_SIZE];
+    struct dirent* dp;
+    int error = 0;
+    while (!error && (dp = readdir(dir)) != NULL) {
+        if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0) {
+            continue;
+        }
+        if (dp->d_type != DT_REG && dp->d_type != DT_DIR) {
+            continue;
+        }
+        snprintf(path, BUFFER_SIZE, "%s/%s", dirpath, dp->d_name);
+        if (filter_excluded(filter, path, dp->d_type == DT_DIR)) {
+            continue;
+        }
+        if (dp->d_type == DT_DIR) {
+            error = build_manifest(path, filter, manifest);
+        }
+        else if (stat(path, &s) == 0) {
+            manifest_add(manifest, ENTRY_FILE, path + strlen(serve_root), &s);
+        }
+    }
+    closedir(dir);
+    return error;
+}
+
+int parse_options(char* message, Schedule schedule, Filter filter) {
+    int options = 0;
+    char* save;
+    for (char* token = strtok_r(message, "\n", &save); token; token = strtok_r(NULL, "\n", &save)) {
+        if (!strcmp(token, "checksum")) {
+            options |= OPT_CHECKSUM;
+        }
+        else if (!strcmp(token, "watch")) {
+            options |= OPT_WATCH;
+        }
+        else if (!strcmp(token, "fdpass")) {
+            options |= OPT_FDPASS;
+        }
+        else if (!strcmp(token, "manifest")) {
+            options |= OPT_MANIFEST;
+        }
+        else if (!strcmp(token, "compress")) {
+            options |= OPT_COMPRESS;
+        }
+        else if (!strncmp(token, "policy=", strlen("policy="))) {
+            if (set_policy(schedule, token + strlen("policy=")) == -1) {
+                return -1;
+            }
+        }
+        else if (!strncmp(token, "include=", strlen("include="))) {
+            if (filter_add(filter, 0, token + strlen("include=")) == -1) {
+                return -1;
+            }
+        }
+        else if (!strncmp(token, "exclude=", strlen("exclude="))) {
+            if (filter_add(filter, 1, token + strlen("exclude=")) == -1) {
+                return -1;
+            }
+        }
+    }
+    return options;
+}
+
+// Index of the first queued file whose session has no file being handled by a worker, -1 if there is none
+// (queue_mutex must be held) - taking files only this way keeps every session's files in their queue order
+static int next_runnable(void) {
+    FileInfo file_info;
+    for (int k = 0; (file_info = peek_file_info(queue, k)); k++) {
+        if (!file_info->session->busy) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+void enqueue_file(char* path, int fd, int block_size, int options, Session session) {
+    // Once a transfer of the session has failed there is no point in queueing more of its files
+    if (retain_session(session) == -1) {
+        return;
+    }
+
+    // Insert the new file_info into the queue if it is not full, otherwise wait
+    FileInfo file_info = create_file_info(fd, block_size, options, path, session);
+    pthread_mutex_lock(&queue_mutex);
+    while (queue->free_slots == 0) {
+        pthread_cond_wait(&queue_non_full, &queue_mutex);
+    }
+    printf("[Communication Thread %ld]: adding file %s to the queue\n", pthread_self(), path);
+    insert_file_info(queue, file_info);
+    clock_gettime(CLOCK_MONOTONIC, &file_info->queued);
+    pthread_cond_signal(&queue_non_empty);
+    pthread_cond_signal(&queue_prefetch);
+
+    // Grow the pool if no worker is idle while a queued file could be sent right away (its client is not being
+    // served by another worker) - the files of a busy client are not work a new worker could do
+    if (pool_idle == 0 && next_runnable() != -1 && pool_size < pool_max) {
+        add_worker("runnable file queued, no idle worker");
+    }
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+void scan_dir(char* dirpath, int fd, int block_size, int options, Schedule schedule, Filter filter, Session session) {
     DIR* dir = opendir(dirpath);
     if (!dir) {
-        close(fd);
-        perror_thr("scan_dir: opendir", pthread_self());
+        // Workers may still be sending the files queued so far, so the session is failed instead of closing the socket
+        fprintf(stderr, "[Communication Thread %ld]: scan_dir: opendir %s\n", pthread_self(), dirpath);
+        fail_session(session);
+        return;
     }
     char path[BUFFER_SIZE];
     struct dirent* dp;
@@ -132,22 +394,23 @@ void scan_dir(char* dirpath, int fd, int block_size, pthread_mutex_t* client_mut
             strcpy(path, dirpath);
             strcat(path, "/");
             strcat(path, dp->d_name);
+            if ((dp->d_type == DT_DIR || dp->d_type == DT_REG) && filter_excluded(filter, path, dp->d_type == DT_DIR)) {
+                continue;
+            }
             switch (dp->d_type) {
             case DT_DIR: {
-                scan_dir(path, fd, block_size, client_mutex);
+                scan_dir(path, fd, block_size, options, schedule, filter, session);
                 break;
             }
             case DT_REG: {
-                // Insert the new file_info into the queue if it is not full, otherwise wait
-                FileInfo file_info = create_file_info(fd, block_size, path, client_mutex);
-                pthread_mutex_lock(&queue_mutex);
-                while (queue->free_slots == 0) {
-                    pthread_cond_wait(&queue_non_full, &queue_mutex);
+                // In FIFO order the file is inserted right away, otherwise it is inserted once the whole directory has been scanned and sorted
+                if (schedule->policy == POLICY_FIFO) {
+                    enqueue_file(path, fd, block_size, options, session);
+                }
+                else {
+                    struct stat s;
+                    schedule_add(schedule, path, (stat(path, &s) == 0) ? s.st_size : 0);
                 }
-                printf("[Communication Thread %ld]: adding file %s to the queue\n", pthread_self(), path);
-                insert_file_info(queue, file_info);
-                pthread_cond_signal(&queue_non_empty);
-                pthread_mutex_unlock(&queue_mutex);
                 break;
             }
             default:
@@ -158,146 +421,1084 @@ void scan_dir(char* dirpath, int fd, int block_size, pthread_mutex_t* client_mut
     closedir(dir);
 }
 
-void send_file(FileInfo file_info) {
+// Time spent reading the file, compressing and writing to the socket while sending content
+// (microseconds, only measured when tracing)
+struct content_timing {
+    long long read;
+    long long compress;
+    long long write;
+};
+
+// Send len bytes of read_fd starting at offset through a read loop, releasing the sent pages from the page cache as we go
+// If crc is not NULL, the CRC32C of the sent bytes is stored in it
+// If timing is not NULL, the time spent reading the file and writing to the socket is added to it
+static int send_content_read(int fd, int read_fd, off_t offset, off_t len, int block_size, uint32_t* crc, struct content_timing* timing) {
+    char* buffer = malloc(sizeof(char) * block_size);
+    off_t sent = 0, dropped = 0;
+    ssize_t bytes;
+    long long t0 = 0, t1 = 0;
+    while (sent < len) {
+        size_t want = (len - sent < block_size) ? (size_t) (len - sent) : (size_t) block_size;
+        if (timing) {
+            t0 = trace_now();
+        }
+        bytes = pread(read_fd, buffer, want, offset + sent);
+        if (timing) {
+            t1 = trace_now();
+            timing->read += t1 - t0;
+        }
+        if (bytes == -1) {
+            free(buffer);
+            return -1;
+        }
+        else if (bytes == 0) {
+            break;      // the file was truncated while being sent
+        }
+        if (crc) {
+            *crc = crc32c(*crc, buffer, bytes);
+        }
+        if (write_all(fd, buffer, bytes) == -1) {
+            free(buffer);
+            return -1;
+        }
+        if (timing) {
+            timing->write += trace_now() - t1;
+        }
+        sent += bytes;
+        if (sent - dropped >= DROP_WINDOW) {
+            posix_fadvise(read_fd, offset + dropped, sent - dropped, POSIX_FADV_DONTNEED);
+            dropped = sent;
+        }
+    }
+    posix_fadvise(read_fd, offset + dropped, sent - dropped, POSIX_FADV_DONTNEED);
+    free(buffer);
+    return (sent == len) ? 0 : -1;
+}
+
+// Jump buffer of the worker that is checksumming mapped pages (NULL when it is not)
+static __thread sigjmp_buf* mapped_guard = NULL;
+static pthread_once_t mapped_once = PTHREAD_ONCE_INIT;
+
+// A mapped page past the end of a file that shrank raises SIGBUS: abandon the checksum that touched it,
+// any other SIGBUS is fatal as usual
+static void mapped_sigbus(int signo) {
+    if (mapped_guard) {
+        siglongjmp(*mapped_guard, 1);
+    }
+    signal(SIGBUS, SIG_DFL);
+    raise(SIGBUS);
+}
+
+static void install_mapped_sigbus(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = mapped_sigbus;
+    action.sa_flags = SA_NODEFER;       // the handler jumps out of itself, SIGBUS must not stay blocked
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGBUS, &action, NULL) == -1) {
+        perror_exit("sigaction");
+    }
+}
+
+// Add len mapped bytes to the CRC32C in crc, returns -1 if the file shrank under them
+static int checksum_mapped(uint32_t* crc, const char* data, size_t len) {
+    sigjmp_buf guard;
+    if (sigsetjmp(guard, 0)) {
+        mapped_guard = NULL;
+        return -1;
+    }
+    mapped_guard = &guard;
+    *crc = crc32c(*crc, data, len);
+    mapped_guard = NULL;
+    return 0;
+}
+
+// Send len bytes of read_fd starting at offset (page aligned) by mapping it MMAP_WINDOW bytes at a time
+// A window that is no longer entirely inside the file is sent through the read loop instead
+// If crc is not NULL, the CRC32C of the sent bytes is stored in it
+// If timing is not NULL, the time spent mapping (and checksumming) the file and writing to the socket is added to it
+// (the pages are read when they are first touched, so without checksums the reads are part of the socket writes)
+static int send_content_mmap(int fd, int read_fd, off_t offset, off_t len, int block_size, uint32_t* crc, struct content_timing* timing) {
+    off_t end = offset + len;
+    long long t0 = 0, t1 = 0;
+    struct stat s;
+    if (crc) {
+        pthread_once(&mapped_once, install_mapped_sigbus);
+    }
+    while (offset < end) {
+        size_t window = (end - offset < MMAP_WINDOW) ? (size_t) (end - offset) : MMAP_WINDOW;
+        if (fstat(read_fd, &s) == -1) {
+            return -1;
+        }
+        if (s.st_size < offset + (off_t) window) {
+            return send_content_read(fd, read_fd, offset, end - offset, block_size, crc, timing);
+        }
+        if (timing) {
+            t0 = trace_now();
+        }
+        char* map = mmap(NULL, window, PROT_READ, MAP_SHARED, read_fd, offset);
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        madvise(map, window, MADV_SEQUENTIAL);
+        madvise(map, window, MADV_WILLNEED);
+        if (timing) {
+            timing->read += trace_now() - t0;
+        }
+        for (size_t pos = 0; pos < window; pos += block_size) {
+            size_t n = (window - pos < (size_t) block_size) ? window - pos : (size_t) block_size;
+            if (timing) {
+                t0 = trace_now();
+            }
+            if (crc && checksum_mapped(crc, map + pos, n) == -1) {
+                munmap(map, window);
+                return -1;
+            }
+            if (timing) {
+                t1 = trace_now();
+                timing->read += t1 - t0;
+            }
+            if (write_all(fd, map + pos, n) == -1) {
+                munmap(map, window);
+                return -1;
+            }
+            if (timing) {
+                timing->write += trace_now() - t1;
+            }
+        }
+        munmap(map, window);
+        posix_fadvise(read_fd, offset, window, POSIX_FADV_DONTNEED);
+        offset += window;
+    }
+    return 0;
+}
+
+// Send len bytes of read_fd starting at offset as one frame of the compressor's (new) deflate stream per block
+// If crc is not NULL, the CRC32C of the raw bytes is stored in it
+// If timing is not NULL, the time spent reading the file, compressing and writing to the socket is added to it
+static int send_content_compressed(int fd, int read_fd, off_t offset, off_t len, int block_size, uint32_t* crc,
+                                   struct content_timing* timing, Compressor compressor) {
+    char* buffer = malloc(sizeof(char) * block_size);
+    off_t sent = 0, dropped = 0;
+    long long t0 = 0, t1 = 0, t2 = 0;
+    compressor_reset(compressor);
+    while (sent < len) {
+        size_t want = (len - sent < block_size) ? (size_t) (len - sent) : (size_t) block_size;
+        if (timing) {
+            t0 = trace_now();
+        }
+        ssize_t bytes = pread(read_fd, buffer, want, offset + sent);
+        if (bytes <= 0) {
+            free(buffer);
+            return -1;      // error, or the file was truncated while being sent
+        }
+        if (timing) {
+            t1 = trace_now();
+            timing->read += t1 - t0;
+        }
+        if (crc) {
+            *crc = crc32c(*crc, buffer, bytes);
+        }
+
+        // Compress the block behind the room left for the frame's header and send the whole frame at once
+        ssize_t compressed = compress_block(compressor, buffer, bytes);
+        if (compressed == -1) {
+            free(buffer);
+            return -1;
+        }
+        struct frame_header header = { htonl(bytes), htonl(compressed) };
+        memcpy(compressor->out, &header, sizeof(header));
+        if (timing) {
+            t2 = trace_now();
+            timing->compress += t2 - t1;
+        }
+        if (write_all(fd, compressor->out, sizeof(header) + compressed) == -1) {
+            free(buffer);
+            return -1;
+        }
+        if (timing) {
+            timing->write += trace_now() - t2;
+        }
+        sent += bytes;
+        if (sent - dropped >= DROP_WINDOW) {
+            posix_fadvise(read_fd, offset + dropped, sent - dropped, POSIX_FADV_DONTNEED);
+            dropped = sent;
+        }
+    }
+    posix_fadvise(read_fd, offset + dropped, sent - dropped, POSIX_FADV_DONTNEED);
+    free(buffer);
+    return 0;
+}
+
+// Every thread that sends files keeps one compressor (its deflate state is large), destroyed when the thread exits
+static pthread_key_t compressor_key;
+static pthread_once_t compressor_once = PTHREAD_ONCE_INIT;
+
+static void destroy_thread_compressor(void* compressor) {
+    destroy_compressor(compressor);
+}
+
+static void create_compressor_key(void) {
+    if (pthread_key_create(&compressor_key, destroy_thread_compressor)) {
+        perror_exit("create_compressor_key: pthread_key_create");
+    }
+}
+
+// The calling thread's compressor (created on first use), NULL if zlib could not initialize one
+static Compressor thread_compressor(int block_size) {
+    pthread_once(&compressor_once, create_compressor_key);
+    Compressor compressor = pthread_getspecific(compressor_key);
+    if (!compressor && (compressor = create_compressor(block_size))) {
+        pthread_setspecific(compressor_key, compressor);
+    }
+    return compressor;
+}
+
+// Report an error of a transfer and close the file being sent - the client's socket is closed by whoever owns the session
+static int transfer_error(int read_fd, const char* message) {
+    fprintf(stderr, "[Worker Thread %ld]: %s\n", pthread_self(), message);
+    if (read_fd >= 0) {
+        close(read_fd);
+    }
+    return -1;
+}
+
+int transfer_file(FileInfo file_info) {
     // Extract information
     char* filepath = file_info->filepath;
     int fd = file_info->socket_fd;
     int block_size = file_info->block_size;
+    Trace trace = file_info->session ? file_info->session->trace : NULL;
+    long long start = trace_now();
+
+    // Open the file, unless the prefetch thread has already done so, and let the kernel know that it is going to be read once, sequentially
+    int read_fd = file_info->read_fd;
+    if (read_fd < 0) {
+        if ((read_fd = open(filepath, O_RDONLY)) < 0) {
+            return transfer_error(read_fd, "send_file: open");
+        }
+        posix_fadvise(read_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(read_fd, 0, 0, POSIX_FADV_WILLNEED);
+    }
+    file_info->read_fd = -1;
 
     // Make sure the given filepath is indeed a file
     struct stat s;
-    if (stat(filepath, &s) == -1) {
-        perror_thr("send_file: stat", pthread_self());
+    if (fstat(read_fd, &s) == -1) {
+        return transfer_error(read_fd, "send_file: stat");
     }
     else if (S_ISREG(s.st_mode) == 0) {
-        perror_thr("send_file: invalid file", pthread_self());
-    }
-
-    // Open the file
-    int read_fd;
-    if ((read_fd = open(filepath, O_RDONLY)) < 0) {
-        close(fd);
-        perror_thr("send_file: open", pthread_self());
+        return transfer_error(read_fd, "send_file: invalid file");
     }
+    trace_span(trace, "open", filepath, start, trace_now());
 
     // Initialize metadata buffer
     char metadata[MAX_REPR];
     memset(metadata, 0, MAX_REPR);
 
-    // Write filepath and wait response
+    // Write filepath (relative to the served root) and wait response
     ssize_t bytes;
-    bytes = write(fd, filepath, strlen(filepath) + 1);
+    const char* public_path = filepath + strlen(serve_root);
+    start = trace_now();
+    bytes = write(fd, public_path, strlen(public_path) + 1);
     if (bytes == -1) {
-        close(fd);
-        close(read_fd);
-        perror_thr("send_file: write", pthread_self());
+        return transfer_error(read_fd, "send_file: write");
     }
     memset(metadata, 0, MAX_REPR);
     bytes = read(fd, metadata, ACK_LEN);
     if (bytes == -1) {
-        close(fd);
-        close(read_fd);
-        perror_thr("send_file: read", pthread_self());
+        return transfer_error(read_fd, "send_file: read");
     }
     if (strcmp(metadata, "FP READ")) {
-        close(fd);
-        close(read_fd);
-        perror_thr("send_file: error during server-client communication", pthread_self());
+        return transfer_error(read_fd, "send_file: error during server-client communication");
     }
+    trace_span(trace, "ack round-trip", filepath, start, trace_now());
     memset(metadata, 0, MAX_REPR);
 
-    // Write file size and wait response
-    int file_size = s.st_size;
-    sprintf(metadata, "%d", file_size);
+    // Write file size (64-bit) and wait response
+    off_t file_size = s.st_size;
+    sprintf(metadata, "%lld", (long long) file_size);
+    start = trace_now();
     bytes = write(fd, metadata, strlen(metadata) + 1);
     if (bytes == -1) {
-        close(fd);
-        close(read_fd);
-        perror_thr("send_file: write", pthread_self());
+        return transfer_error(read_fd, "send_file: write");
     }
     memset(metadata, 0, MAX_REPR);
 
     bytes = read(fd, metadata, ACK_LEN);
     if (bytes == -1) {
-        close(fd);
-        close(read_fd);
-        perror_thr("send_file: read", pthread_self());
+        return transfer_error(read_fd, "send_file: read");
     }
     if (strcmp(metadata, "FS READ")) {
-        close(fd);
-        close(read_fd);
-        perror_thr("send_file: error during server-client communication", pthread_self());
+        return transfer_error(read_fd, "send_file: error during server-client communication");
     }
+    trace_span(trace, "ack round-trip", filepath, start, trace_now());
     memset(metadata, 0, MAX_REPR);
 
-    // Sent file content
-    char* buffer = malloc(sizeof(char) * block_size);
-    memset(buffer, 0, block_size);
-    while (1) {
-        bytes = read(read_fd, buffer, block_size);
-        if (bytes == -1) {
-            close(fd);
-            close(read_fd);
-            perror_thr("send_file: read", pthread_self());
-        }
-        else if (bytes == 0) {
-            break;
+    // On a Unix domain socket pass the open file instead of its content - the client copies it locally
+    if (file_info->options & OPT_FDPASS) {
+        start = trace_now();
+        if (send_fd(fd, read_fd) == -1) {
+            return transfer_error(read_fd, "send_file: send_fd");
         }
-        bytes = write(fd, buffer, bytes);
-        if (bytes == -1) {
-            close(fd);
-            close(read_fd);
-            perror_thr("send_file: write", pthread_self());
-        }
-        memset(buffer, 0, block_size);
+        trace_span(trace, "socket write", filepath, start, trace_now());
+        close(read_fd);
+        return 0;
     }
 
-    memset(buffer, 0, block_size);
-    bytes = read(fd, buffer, MAX_REPR);
-    if (bytes == -1) {
-        perror_thr("send_file: read", pthread_self());
+    // With compression decide whether the file is worth it - a file that is not is sent as stored frames,
+    // one per segment, while the segments of any other file are deflated block by block
+    Compressor compressor = NULL;
+    int compress = file_info->options & OPT_COMPRESS;
+    if (compress) {
+        start = trace_now();
+        compressor = thread_compressor(block_size);
+        if (compressor && !compress_worth(compressor, read_fd, filepath, file_size)) {
+            compressor = NULL;
+        }
+        trace_span(trace, compressor ? "compress probe" : "compress skip", filepath, start, trace_now());
     }
-    int no_files = atoi(buffer);
-    if (!no_files) {
-        // Task completed: close fd and free client's mutex
-        printf("[Worker Thread %ld]: all files sent, closing client socket %d\n", pthread_self(), fd);
-        close(fd);
-        free(file_info->mutex);
+
+    // Send file content, one segment at a time. With checksums every segment is followed by its CRC32C
+    // and the client answers whether it matched - a mismatched segment is sent again up to MAX_RETRIES times
+    // When tracing, a segment's span is split into the time spent reading the file, compressing and writing to the socket
+    int checksum = file_info->options & OPT_CHECKSUM;
+    off_t segment = (checksum || compress) ? CHECKSUM_CHUNK : file_size;
+    off_t offset = 0;
+    int retries = 0;
+    while (offset < file_size) {
+        off_t len = (file_size - offset < segment) ? file_size - offset : segment;
+        uint32_t crc = 0;
+        int error;
+        struct content_timing timing = { 0, 0, 0 };
+        start = trace_now();
+        if (compress && !compressor) {
+            // A stored frame announces the raw segment that follows
+            struct frame_header stored = { htonl(len), 0 };
+            if (write_all(fd, &stored, sizeof(stored)) == -1) {
+                return transfer_error(read_fd, "send_file: write");
+            }
+        }
+        if (compressor) {
+            error = send_content_compressed(fd, read_fd, offset, len, block_size, checksum ? &crc : NULL, trace ? &timing : NULL, compressor);
+        }
+        else if (mmap_send) {
+            error = send_content_mmap(fd, read_fd, offset, len, block_size, checksum ? &crc : NULL, trace ? &timing : NULL);
+        }
+        else {
+            error = send_content_read(fd, read_fd, offset, len, block_size, checksum ? &crc : NULL, trace ? &timing : NULL);
+        }
+        if (error == -1) {
+            return transfer_error(read_fd, "send_file: send content");
+        }
+        if (trace) {
+            trace_span(trace, "send content", filepath, start, trace_now());
+            long long mark = start + timing.read;
+            trace_span(trace, "disk read", filepath, start, mark);
+            if (compressor) {
+                trace_span(trace, "compress", filepath, mark, mark + timing.compress);
+                mark += timing.compress;
+            }
+            trace_span(trace, "socket write", filepath, mark, mark + timing.write);
+        }
+        if (checksum) {
+            sprintf(metadata, "%08x", crc);
+            start = trace_now();
+            bytes = write(fd, metadata, strlen(metadata) + 1);
+            if (bytes == -1) {
+                return transfer_error(read_fd, "send_file: write");
+            }
+            memset(metadata, 0, MAX_REPR);
+            bytes = read(fd, metadata, ACK_LEN);
+            if (bytes == -1) {
+                return transfer_error(read_fd, "send_file: read");
+            }
+            if (!strcmp(metadata, "CK FAIL")) {
+                if (++retries > MAX_RETRIES) {
+                    return transfer_error(read_fd, "send_file: checksum mismatch persisted");
+                }
+                printf("[Worker Thread %ld]: checksum mismatch, resending %s at offset %lld\n", pthread_self(), filepath, (long long) offset);
+                memset(metadata, 0, MAX_REPR);
+                continue;
+            }
+            else if (strcmp(metadata, "CK GOOD")) {
+                return transfer_error(read_fd, "send_file: error during server-client communication");
+            }
+            trace_span(trace, "ack round-trip", filepath, start, trace_now());
+            memset(metadata, 0, MAX_REPR);
+        }
+        offset += len;
+        retries = 0;
     }
 
     // Cleanup
-    free(buffer);
     close(read_fd);
+    return 0;
 }
 
+int send_file(FileInfo file_info) {
+    if (transfer_file(file_info) == -1) {
+        return -1;
+    }
 
+    // Read the number of files that remain to be received
+    char metadata[MAX_REPR];
+    memset(metadata, 0, MAX_REPR);
+    long long start = trace_now();
+    ssize_t bytes = read(file_info->socket_fd, metadata, MAX_REPR);
+    if (bytes <= 0) {
+        return transfer_error(-1, "send_file: read");
+    }
+    trace_span(file_info->session ? file_info->session->trace : NULL, "ack round-trip", file_info->filepath, start, trace_now());
+    return atoi(metadata);
+}
 
-/////////////////////////////////////////////// Client related ///////////////////////////////////////////////
-
-int receive(int socket, char* dirpath, int block_size) {
-    // We use two static buffers (avoid stack allocation each time):
-    // - buffer is used to read/write from/to socket and is modified
-    // - b_buffer is used to store important info so it doesn't get lost
-    static char buffer[BUFFER_SIZE];
-    static char b_buffer[BUFFER_SIZE];
-
-    // Initialize variables
-    ssize_t bytes;
-    int file_size, count;
-    bytes = file_size = count = 0;
 
-    // Read filename and make sure that  the task has not been completed
-    bytes = read(socket, buffer, BUFFER_SIZE);
-    if (bytes == -1) {
-        perror_exit("receive: read");
+// Send a change event (paths relative to the served root) and wait for response
+static int send_event(int fd, char type, const char* path, const char* new_path) {
+    char message[2 * BUFFER_SIZE];
+    size_t len = snprintf(message, BUFFER_SIZE, "%c %s", type, path + strlen(serve_root)) + 1;
+    if (new_path) {
+        len += snprintf(message + len, BUFFER_SIZE, "%s", new_path + strlen(serve_root)) + 1;
     }
-    printf("\nFile to be received: %s\n", buffer);
-
-    // Send response
-    strcat(b_buffer, "FP READ");
-    bytes = write(socket, b_buffer, ACK_LEN);
-    if (bytes == -1) {
-        perror_exit("receive: write");
+    if (write(fd, message, len) == -1) {
+        return -1;
+    }
+    memset(message, 0, ACK_LEN + 1);
+    if (read(fd, message, ACK_LEN) <= 0 || strcmp(message, "EV READ")) {
+        return -1;
+    }
+    return 0;
+}
+
+// Send a modified file, or every file of a directory that has not been sent yet (for example moved in from an excluded path)
+static int send_modified(Filter filter, char* path, int fd, int block_size, int options) {
+    if (is_file(path) == 1) {
+        printf("[Communication Thread %ld]: modified %s\n", pthread_self(), path);
+        if (send_event(fd, 'M', path, NULL) == -1) {
+            return -1;
+        }
+        FileInfo file_info = create_file_info(fd, block_size, options, path, NULL);
+        int error = transfer_file(file_info);
+        destroy_file_info(file_info);
+        return error;
+    }
+    DIR* dir = opendir(path);
+    if (!dir) {
+        return 0;
+    }
+    char child[BUFFER_SIZE];
+    struct dirent* dp;
+    int error = 0;
+    while (!error && (dp = readdir(dir)) != NULL) {
+        if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(child, BUFFER_SIZE, "%s/%s", path, dp->d_name);
+        if ((dp->d_type == DT_DIR || dp->d_type == DT_REG) && !filter_excluded(filter, child, dp->d_type == DT_DIR)) {
+            error = send_modified(filter, child, fd, block_size, options);
+        }
+    }
+    closedir(dir);
+    return error;
+}
+
+// Send the sorted manifest: its length, then the manifest itself, waiting for a response to each
+static int send_manifest(int fd, Manifest manifest) {
+    manifest_sort(manifest);
+    size_t len;
+    char* blob = manifest_encode(manifest, &len);
+    char metadata[MAX_REPR];
+    memset(metadata, 0, MAX_REPR);
+    sprintf(metadata, "%zu", len);
+    int error = (write(fd, metadata, strlen(metadata) + 1) == -1);
+    memset(metadata, 0, MAX_REPR);
+    error = error || read(fd, metadata, ACK_LEN) <= 0 || strcmp(metadata, "ML READ");
+    error = error || write_all(fd, blob, len) == -1;
+    memset(metadata, 0, MAX_REPR);
+    error = error || read(fd, metadata, ACK_LEN) <= 0 || strcmp(metadata, "MF READ");
+    free(blob);
+    return error ? -1 : 0;
+}
+
+void stream_changes(Watcher watcher, Filter filter, int fd, int block_size, int options) {
+    while (1) {
+        // Wait for changes - the client never writes while watching, so a readable socket means it has disconnected
+        struct pollfd fds[2] = { { .fd = watcher->fd, .events = POLLIN }, { .fd = fd, .events = POLLIN } };
+        if (poll(fds, 2, -1) < 0 || fds[1].revents) {
+            return;
+        }
+        if (collect_changes(watcher, WATCH_DEBOUNCE_MS, WATCH_MAX_DELAY_MS) < 0) {
+            return;
+        }
+
+        // Send every change: 'M' is followed by the file itself, 'D' and 'R' are applied by the client directly
+        for (int i = 0; i < watcher->no_changes; i++) {
+            // Changes of excluded paths are not sent: a rename out of the filter becomes a deletion
+            // and a rename into it sends the renamed files
+            struct change* c = &watcher->changes[i];
+            int error = 0;
+            int is_directory = (is_dir(c->new_path ? c->new_path : c->path) == 1);
+            int excluded = filter_path_excluded(filter, c->path, is_directory);
+            if (c->type == CHANGE_RENAMED) {
+                int new_excluded = filter_path_excluded(filter, c->new_path, is_directory);
+                if (!excluded && new_excluded) {
+                    printf("[Communication Thread %ld]: deleted %s\n", pthread_self(), c->path);
+                    error = send_event(fd, 'D', c->path, NULL);
+                }
+                else if (excluded && !new_excluded) {
+                    error = send_modified(filter, c->new_path, fd, block_size, options);
+                }
+                else if (!excluded) {
+                    printf("[Communication Thread %ld]: renamed %s to %s\n", pthread_self(), c->path, c->new_path);
+                    error = send_event(fd, 'R', c->path, c->new_path);
+                }
+            }
+            else if (excluded) {
+                continue;
+            }
+            else if (c->type == CHANGE_DELETED || file_exists(c->path) == 0) {
+                printf("[Communication Thread %ld]: deleted %s\n", pthread_self(), c->path);
+                error = send_event(fd, 'D', c->path, NULL);
+            }
+            else if (is_file(c->path) == 1) {
+                error = send_modified(filter, c->path, fd, block_size, options);
+            }
+            if (error) {
+                clear_changes(watcher);
+                return;
+            }
+        }
+        clear_changes(watcher);
+    }
+}
+
+
+
+// Milliseconds elapsed from start to end
+static double elapsed_ms(const struct timespec* start, const struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+// Print the pool size with the time since the server started, so that the size over time can be followed
+static void report_pool(const char* event) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("[Pool %.3fs]: %d workers (%s)\n", elapsed_ms(&pool_start, &now) / 1000, pool_size, event);
+}
+
+int add_worker(const char* reason) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+
+    // Pin the worker to the next CPU the process may run on (round robin), so that it keeps its caches warm
+    int pinned = 0;
+    if (pool_affinity && CPU_COUNT(&pool_cpus) > 0) {
+        int k = pool_next_cpu++ % CPU_COUNT(&pool_cpus);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &pool_cpus) && k-- == 0) {
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(cpu, &cpus);
+                pinned = (pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus) == 0);
+                break;
+            }
+        }
+    }
+    pthread_t worker;
+    int error = pthread_create(&worker, &attr, process, NULL);
+    pthread_attr_destroy(&attr);
+
+    // If the CPU cannot be used (for example the cpuset changed) start the worker unpinned
+    if (error && pinned) {
+        fprintf(stderr, "add_worker: could not pin worker: %s\n", strerror(error));
+        error = pthread_create(&worker, NULL, process, NULL);
+    }
+    if (error) {
+        fprintf(stderr, "add_worker: pthread_create: %s\n", strerror(error));
+        return -1;
+    }
+    pool_size++;
+    report_pool(reason);
+    return 0;
+}
+
+void start_server(int thread_pool_size, int queue_size) {
+    // Create a queue and initialize it's mutex and cond variables
+    // (idle workers time out on queue_non_empty, so it uses the monotonic clock)
+    queue = create_queue(queue_size);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&queue_mutex, NULL);
+    pthread_cond_init(&queue_non_empty, &attr);
+    pthread_cond_init(&queue_non_full, NULL);
+    pthread_cond_init(&queue_prefetch, NULL);
+    pthread_cond_init(&prefetch_done, NULL);
+    pthread_condattr_destroy(&attr);
+
+    // Create workers thread pool with its minimum size, it grows up to pool_max under load
+    pool_min = thread_pool_size;
+    if (pool_max < pool_min) {
+        pool_max = pool_min;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &pool_start);
+    if (sched_getaffinity(0, sizeof(pool_cpus), &pool_cpus) == -1) {
+        CPU_ZERO(&pool_cpus);
+    }
+    pthread_mutex_lock(&queue_mutex);
+    for (int i = 0; i < thread_pool_size; i++) {
+        if (add_worker("started") == -1) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_mutex_unlock(&queue_mutex);
+
+    // Create the prefetch thread that warms the upcoming files while the workers are sending
+    if (prefetch_depth > 0) {
+        pthread_t prefetcher;
+        pthread_create(&prefetcher, NULL, prefetch, NULL);
+    }
+}
+
+int create_unix_listener(const char* path) {
+    // Create socket
+    int listen_socket;
+    if ((listen_socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror_exit("create_unix_listener: socket");
+    }
+
+    // Initialize sockaddr_un struct, removing a stale socket left by a previous server
+    struct sockaddr_un server;
+    memset(&server, 0, sizeof(server));
+    server.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(server.sun_path)) {
+        fprintf(stderr, "create_unix_listener: socket path is too long\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(server.sun_path, path);
+
+    // Only a socket is removed - any other file at the path is left alone and bind fails on it
+    struct stat s;
+    if (lstat(path, &s) == 0 && S_ISSOCK(s.st_mode)) {
+        unlink(path);
+    }
+
+    // Bind socket to address
+    if (bind(listen_socket, (struct sockaddr*) &server, sizeof(server)) < 0) {
+        perror_exit("create_unix_listener: bind");
+    }
+
+    // Listen for connections
+    if (listen(listen_socket, MAX_CONNECTIONS) < 0) {
+        perror_exit("create_unix_listener: listen");
+    }
+    return listen_socket;
+}
+
+int create_listener(int port_number) {
+    // Create socket
+    int listen_socket;
+    if ((listen_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror_exit("create_listener: socket");
+    }
+
+    // Initialize sockaddr_in struct
+    struct sockaddr_in server;
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(INADDR_ANY);
+    server.sin_port = htons(port_number);
+
+    int reuse = 1;
+    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, (const char*) &reuse, sizeof(reuse)) < 0) {
+        perror_exit("create_listener: setsockopt");
+    }
+
+    // Bind socket to address
+    if (bind(listen_socket, (struct sockaddr*) &server, sizeof(server)) < 0) {
+        perror_exit("create_listener: bind");
+    }
+
+    // Listen for connections
+    if (listen(listen_socket, MAX_CONNECTIONS) < 0) {
+        perror_exit("create_listener: listen");
+    }
+    return listen_socket;
+}
+
+void* serve(void* args) {
+    arg_set* a = args;
+    int listen_socket = a->fd;
+    int block_size = a->block_size;
+
+    int client_socket;
+    struct sockaddr_storage client;
+    socklen_t client_len;
+
+    while (1) {
+        // Accept a connection request
+        client_len = sizeof(client);
+        if ((client_socket = accept(listen_socket, (struct sockaddr*) &client, &client_len)) < 0) {
+            perror_exit("serve: accept");
+        }
+
+        // Disable Nagle's algorithm: every message is followed by a wait for the client's response,
+        // so small writes must not be held back waiting for a delayed ack
+        int nodelay = 1;
+        if (client.ss_family == AF_INET && setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, (const char*) &nodelay, sizeof(nodelay)) < 0) {
+            perror_exit("serve: setsockopt");
+        }
+
+        // Set proper args for communication's thread routine - they are allocated per connection
+        // since the thread may not have read them before the next connection is accepted
+        arg_set* args = malloc(sizeof(*args));
+        args->fd = client_socket;
+        args->block_size = block_size;
+
+        // Create a new communication thread
+        pthread_t thr;
+        if (pthread_create(&thr, NULL, client_communication, (void*) args)) {
+            fprintf(stderr, "serve: pthread_create\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return NULL;
+}
+
+void close_session(Session session, int fd) {
+    close(fd);
+    if (session->trace) {
+        if (write_trace(session->trace) == -1) {
+            fprintf(stderr, "close_session: could not write trace %s: %s\n", session->trace->path, strerror(errno));
+        }
+        else {
+            printf("[Thread %ld]: trace written to %s\n", pthread_self(), session->trace->path);
+        }
+    }
+    destroy_session(session);
+}
+
+// Drop a client during the handshake: free what the communication thread has set up for it (the watcher and
+// the manifest may be NULL), close fd and exit the thread
+static void drop_client(int sock, Schedule schedule, Filter filter, Watcher watcher, Manifest manifest, const char* message) {
+    destroy_schedule(schedule);
+    destroy_filter(filter);
+    if (watcher) {
+        destroy_watcher(watcher);
+    }
+    destroy_manifest(manifest);
+    close(sock);
+    perror_thr(message, pthread_self());
+}
+
+/// Note: if an error occurs inside the thread we close the socked and exit the thread. We do not exit the server process !!! ///
+
+void* client_communication(void* args) {
+    // Fetch information
+    arg_set* a = args;
+    int sock = a->fd;
+    int block_size = a->block_size;
+    free(a);
+
+    // Detach communication thread - we do not need to join
+    int error;
+    if ((error = pthread_detach(pthread_self()))) {
+        close(sock);
+        perror_thr("client_communication: pthread_detach", pthread_self());
+    }
+
+    // Initialize
+    char buffer[BUFFER_SIZE];
+    memset(buffer, 0, BUFFER_SIZE);
+
+    // Read directory path and map it onto the served root (empty for the server, the results directory for a relay)
+    ssize_t bytes;
+    bytes = read(sock, buffer, BUFFER_SIZE);
+    if (bytes == -1) {
+        close(sock);
+        perror_thr("client_communication: read", pthread_self());
+    }
+    char dirpath[BUFFER_SIZE];
+    snprintf(dirpath, BUFFER_SIZE, "%s%s", serve_root, buffer);
+
+    // Send response and read the session options
+    char options_msg[BUFFER_SIZE];
+    memset(options_msg, 0, BUFFER_SIZE);
+    bytes = write(sock, "DP READ", ACK_LEN);
+    if (bytes == -1) {
+        close(sock);
+        perror_thr("client_communication: write", pthread_self());
+    }
+    bytes = read(sock, options_msg, BUFFER_SIZE - 1);
+    if (bytes == -1) {
+        close(sock);
+        perror_thr("client_communication: read", pthread_self());
+    }
+    Schedule schedule = create_schedule(dirpath);
+    Filter filter = create_filter(dirpath);
+    int options = parse_options(options_msg, schedule, filter);
+
+    if (options < 0) {
+        bytes = write(sock, "INVALID OPTIONS", strlen("INVALID OPTIONS") + 1);
+        drop_client(sock, schedule, filter, NULL, NULL, (bytes == -1) ? "client_communication: write" : "client_communication: invalid options");
+    }
+
+    // Files can only be passed to a client on the same host (Unix domain socket)
+    struct sockaddr_storage local;
+    socklen_t local_len = sizeof(local);
+    if ((options & OPT_FDPASS) && (getsockname(sock, (struct sockaddr*) &local, &local_len) == -1 || local.ss_family != AF_UNIX)) {
+        options &= ~OPT_FDPASS;
+    }
+
+    // Passed files carry no content to compress
+    if (options & OPT_FDPASS) {
+        options &= ~OPT_COMPRESS;
+    }
+
+    // Ensure the path corresponds indeed to a directory
+    error = is_dir(dirpath);
+    if (error != 1) {
+        bytes = write(sock, "INVALID DIR", strlen("INVALID DIR") + 1);
+        drop_client(sock, schedule, filter, NULL, NULL, (bytes == -1) ? "client_communication: write" : "client_communication: invalid directory");
+    }
+
+    // In watch mode start watching before scanning, so that no change made during the initial clone is missed
+    Watcher watcher = NULL;
+    if ((options & OPT_WATCH) && (watcher = create_watcher(dirpath)) == NULL) {
+        bytes = write(sock, "COULD NOT WATCH DIR", strlen("COULD NOT WATCH DIR") + 1);
+        drop_client(sock, schedule, filter, NULL, NULL, (bytes == -1) ? "client_communication: write" : "create_watcher: inotify");
+    }
+
+    // A relay streams an unfiltered FIFO clone of the directory it is still receiving as the files land (without a manifest),
+    // any other request waits until its own clone has been completed
+    int streaming = 0;
+    if (relay) {
+        streaming = relay_attach(relay, buffer, schedule->policy == POLICY_FIFO && !filter_active(filter) && !(options & OPT_MANIFEST));
+    }
+
+    // Find the number of files that reside inside the given directory (and are not excluded by the filter),
+    // with a manifest list them as well
+    int no_files;
+    Manifest manifest = NULL;
+    long long scan_start = trace_now();
+    if (streaming) {
+        no_files = relay->total;
+    }
+    else if (options & OPT_MANIFEST) {
+        manifest = create_manifest();
+        no_files = (build_manifest(dirpath, filter, manifest) == -1) ? -1 : manifest->no_files;
+    }
+    else {
+        no_files = count_no_files(dirpath, filter);
+    }
+    long long scan_end = trace_now();
+
+    // If we could not open the directory or some nested directory (for example no permissions)
+    // (every exit from here on also frees the watcher, whose inotify instance would otherwise leak)
+    if (no_files < 0) {
+        bytes = write(sock, "COULD NOT OPEN DIR/S", strlen("COULD NOT OPEN DIR/S") + 1);
+        drop_client(sock, schedule, filter, watcher, manifest, (bytes == -1) ? "client_communication: write" : "count_no_files: opendir");
+    }
+
+    // Send the number of files that reside inside the given directory
+    char msg[MAX_REPR];
+    memset(msg, 0, MAX_REPR);
+    sprintf(msg, "%d", no_files);
+    bytes = write(sock, msg, strlen(msg) + 1);
+    if (bytes == -1) {
+        drop_client(sock, schedule, filter, watcher, manifest, "client_communication: write");
+    }
+
+    // Wait for response
+    memset(msg, 0, MAX_REPR);
+    bytes = read(sock, msg, ACK_LEN);
+    if (bytes == -1) {
+        drop_client(sock, schedule, filter, watcher, manifest, "client_communication: read");
+    }
+    if (strcmp(msg, "NF READ")) {
+        drop_client(sock, schedule, filter, watcher, manifest, "client_communication: error during server-client communication");
+    }
+
+    // Write block size and wait response
+    memset(msg, 0, MAX_REPR);
+    sprintf(msg, "%d", block_size);
+    bytes = write(sock, msg, strlen(msg) + 1);
+    if (bytes == -1) {
+        drop_client(sock, schedule, filter, watcher, manifest, "client_communication: write");
+    }
+    memset(msg, 0, MAX_REPR);
+    bytes = read(sock, msg, ACK_LEN);
+    if (bytes == -1) {
+        drop_client(sock, schedule, filter, watcher, manifest, "client_communication: read");
+    }
+    if (strcmp(msg, "BS READ")) {
+        drop_client(sock, schedule, filter, watcher, manifest, "client_communication: error during server-client communication");
+    }
+
+    // Send the manifest before any file
+    if (manifest) {
+        if (send_manifest(sock, manifest) == -1) {
+            drop_client(sock, schedule, filter, watcher, manifest, "send_manifest: error during server-client communication");
+        }
+        destroy_manifest(manifest);
+    }
+
+    // Create and initialize client's session
+    Session session = create_session();
+
+    // In tracing mode the session records its spans until it ends
+    if (trace_dir) {
+        char trace_path[PATH_MAX];
+        snprintf(trace_path, PATH_MAX, "%s/trace-%d-%d.json", trace_dir, getpid(), atomic_fetch_add(&trace_sessions, 1));
+        session->trace = create_trace(trace_path);
+        trace_span(session->trace, "directory scan", dirpath, scan_start, scan_end);
+    }
+
+    // Insert the directory's content into the queue
+    long long enqueue_start = trace_now();
+    if (streaming) {
+        printf("[Communication Thread %ld]: relaying directory %s as it is received\n", pthread_self(), dirpath);
+        for (int i = 0; i < no_files; i++) {
+            enqueue_file(relay_next(relay, i), sock, block_size, options, session);
+        }
+    }
+    else {
+        printf("[Communication Thread %ld]: about to scan directory %s\n", pthread_self(), dirpath);
+        scan_dir(dirpath, sock, block_size, options, schedule, filter, session);
+    }
+
+    // Insert the files in the order of the session's scheduling policy
+    if (schedule->policy != POLICY_FIFO) {
+        schedule_sort(schedule);
+        for (int i = 0; i < schedule->count; i++) {
+            enqueue_file(schedule->entries[i].path, sock, block_size, options, session);
+        }
+    }
+    destroy_schedule(schedule);
+    trace_span(session->trace, "enqueue", dirpath, enqueue_start, trace_now());
+
+    // In watch mode wait for the workers to release every file of the initial clone and then stream the changes
+    // until the client disconnects (unless the clone failed)
+    if (watcher) {
+        if (!sync_session(session)) {
+            printf("[Communication Thread %ld]: watching directory %s\n", pthread_self(), dirpath);
+            stream_changes(watcher, filter, sock, block_size, options);
+        }
+        printf("[Communication Thread %ld]: client disconnected, closing client socket %d\n", pthread_self(), sock);
+        destroy_watcher(watcher);
+        close_session(session, sock);
+    }
+    else {
+        // Drop the communication thread's reference - if the workers have already released every file
+        // (or there was nothing to send) the socket is closed here
+        if (release_session(session)) {
+            close_session(session, sock);
+        }
+    }
+    destroy_filter(filter);
+
+    printf("[Communication Thread %ld]: exiting...\n", pthread_self());
+    pthread_exit(NULL);
+}
+
+
+/////////////////////////////////////////////// Client related ///////////////////////////////////////////////
+
+// Receive len bytes of content from socket and write them to write_fd
+// If crc is not NULL, the CRC32C of the received bytes is stored in it
+static void receive_content(int socket, int write_fd, char* content, int block_size, long long len, uint32_t* crc) {
+    long long count = 0;
+    ssize_t bytes;
+    while (count < len) {
+        size_t want = (len - count < block_size) ? (size_t) (len - count) : (size_t) block_size;
+        bytes = read(socket, content, want);
+        if (bytes == -1) {
+            perror_exit("receive: read");
+        }
+        else if (bytes == 0) {
+            fprintf(stderr, "receive: connection closed by the server\n");
+            exit(EXIT_FAILURE);
+        }
+        if (crc) {
+            *crc = crc32c(*crc, content, bytes);
+        }
+        count += bytes;
+        if (write_all(write_fd, content, bytes) == -1) {
+            perror_exit("receive: write");
+        }
+    }
+}
+
+// Receive len bytes of a segment sent as frames and write them to write_fd, inflating the deflated frames
+// If crc is not NULL, the CRC32C of the raw bytes is stored in it
+// Returns -1 if a frame could not be inflated - the rest of the segment is still read, so the socket stays in sync
+static int receive_frames(int socket, int write_fd, char* content, int block_size, long long len, uint32_t* crc, Decompressor decompressor) {
+    long long count = 0;
+    int corrupted = 0;
+    decompressor_reset(decompressor);
+    while (count < len) {
+        struct frame_header header;
+        if (read_all(socket, &header, sizeof(header)) == -1) {
+            fprintf(stderr, "receive: connection closed by the server\n");
+            exit(EXIT_FAILURE);
+        }
+        long long raw_len = ntohl(header.raw_len);
+        size_t comp_len = ntohl(header.comp_len);
+        if (raw_len == 0 || raw_len > len - count || (comp_len && (raw_len > block_size || comp_len > decompressor->in_size))) {
+            fprintf(stderr, "receive: invalid frame\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // A stored frame is followed by the raw bytes
+        if (comp_len == 0) {
+            receive_content(socket, write_fd, content, block_size, raw_len, crc);
+            count += raw_len;
+            continue;
+        }
+        if (read_all(socket, decompressor->in, comp_len) == -1) {
+            fprintf(stderr, "receive: connection closed by the server\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // Once the stream is broken its later frames cannot be inflated either
+        if (corrupted || decompress_block(decompressor, comp_len, content, raw_len) == -1) {
+            corrupted = 1;
+            memset(content, 0, raw_len);
+        }
+        if (crc) {
+            *crc = crc32c(*crc, content, raw_len);
+        }
+        if (write_all(write_fd, content, raw_len) == -1) {
+            perror_exit("receive: write");
+        }
+        count += raw_len;
+    }
+    return corrupted ? -1 : 0;
+}
+
+off_t receive(int socket, char* dirpath, int block_size, int options) {
+    // We use two static buffers (avoid stack allocation each time):
+    // - buffer is used to read/write from/to socket and is modified
+    // - b_buffer is used to store important info so it doesn't get lost
+    static char buffer[BUFFER_SIZE];
+    static char b_buffer[BUFFER_SIZE];
+
+    // Initialize variables
+    ssize_t bytes = 0;
+    long long file_size = 0, count = 0;
+
+    // Read filename and make sure that  the task has not been completed
+    bytes = read(socket, buffer, BUFFER_SIZE);
+    if (bytes == -1) {
+        perror_exit("receive: read");
+    }
+    printf("\nFile to be received: %s\n", buffer);
+
+    // Send response
+    strcat(b_buffer, "FP READ");
+    bytes = write(socket, b_buffer, ACK_LEN);
+    if (bytes == -1) {
+        perror_exit("receive: write");
     }
     memset(b_buffer, 0, BUFFER_SIZE);
     strcat(b_buffer, dirpath);
@@ -309,12 +1510,12 @@ int receive(int socket, char* dirpath, int block_size) {
     recursive_mkdir(b_buffer);
     memset(b_buffer, 0, BUFFER_SIZE);
 
-    // If the current file exists, delete it
+    // If the current file exists, delete it (unless it has been preallocated from the manifest and can be written over)
     strcat(b_buffer, dirpath);
     strcat(b_buffer, dir_name);
     strcat(b_buffer, "/");
     strcat(b_buffer, base_name);
-    if (file_exists(b_buffer)) {
+    if (file_exists(b_buffer) && (!(options & OPT_MANIFEST) || access(b_buffer, W_OK))) {
         if (remove(b_buffer)) {
             perror_exit("receive: remove");
         }
@@ -331,8 +1532,8 @@ int receive(int socket, char* dirpath, int block_size) {
     if (bytes == -1) {
         perror_exit("receive: read");
     }
-    file_size = atoi(buffer);
-    printf("File size: %d bytes\n", file_size);
+    file_size = strtoll(buffer, NULL, 10);
+    printf("File size: %lld bytes\n", file_size);
 
     // Send response
     memset(buffer, 0, BUFFER_SIZE);
@@ -343,28 +1544,233 @@ int receive(int socket, char* dirpath, int block_size) {
     }
     memset(buffer, 0, BUFFER_SIZE);
 
-    // Read server's file content and write it to client's file
+    // Read server's file content and write it to client's file, one segment at a time
+    // (never read past the end of a segment so that the next message stays in the socket)
+    // With checksums each segment is verified against the server's CRC32C and received again on a mismatch
     printf("Receiving file's content...\n");
+    if (options & OPT_FDPASS) {
+        // Same host: the server passed the open file, copy it locally
+        int read_fd = receive_fd(socket);
+        if (read_fd == -1) {
+            perror_exit("receive: receive_fd");
+        }
+        if (copy_local(read_fd, write_fd, file_size) == -1) {
+            perror_exit("receive: copy_local");
+        }
+        close(read_fd);
+        count = file_size;
+    }
+    // With compression the content arrives as frames (the decompressor is kept for the next files)
+    static Decompressor decompressor = NULL;
+    int compress = options & OPT_COMPRESS;
+    if (compress && !decompressor && !(decompressor = create_decompressor(block_size))) {
+        fprintf(stderr, "receive: could not initialize zlib\n");
+        exit(EXIT_FAILURE);
+    }
+    char* content = malloc(sizeof(char) * block_size);
+    int checksum = options & OPT_CHECKSUM;
+    long long segment = (checksum || compress) ? CHECKSUM_CHUNK : file_size;
+    int retries = 0;
     while (count < file_size) {
-        bytes = read(socket, buffer, block_size);
-        if (bytes == -1) {
-            perror_exit("receive: read");
+        long long len = (file_size - count < segment) ? file_size - count : segment;
+        uint32_t crc = 0;
+        int corrupted = 0;
+        if (compress) {
+            corrupted = receive_frames(socket, write_fd, content, block_size, len, checksum ? &crc : NULL, decompressor);
         }
-        count += bytes;
-        bytes = write(write_fd, buffer, bytes);
-        if (bytes == -1) {
-            perror_exit("receive: write");
+        else {
+            receive_content(socket, write_fd, content, block_size, len, checksum ? &crc : NULL);
         }
-        memset(buffer, 0, BUFFER_SIZE);
+        if (corrupted && !checksum) {
+            fprintf(stderr, "receive: corrupted compressed content\n");
+            exit(EXIT_FAILURE);
+        }
+        if (checksum) {
+            bytes = read(socket, buffer, MAX_REPR);
+            if (bytes == -1) {
+                perror_exit("receive: read");
+            }
+            int match = !corrupted && (strtoul(buffer, NULL, 16) == crc);
+            memset(buffer, 0, BUFFER_SIZE);
+            strcat(buffer, match ? "CK GOOD" : "CK FAIL");
+            bytes = write(socket, buffer, ACK_LEN);
+            if (bytes == -1) {
+                perror_exit("receive: write");
+            }
+            memset(buffer, 0, BUFFER_SIZE);
+            if (!match) {
+                if (++retries > MAX_RETRIES) {
+                    fprintf(stderr, "receive: checksum mismatch persisted\n");
+                    exit(EXIT_FAILURE);
+                }
+                fprintf(stderr, "Checksum mismatch at offset %lld, requesting the segment again\n", count);
+                if (lseek(write_fd, count, SEEK_SET) == -1) {
+                    perror_exit("receive: lseek");
+                }
+                continue;
+            }
+        }
+        count += len;
+        retries = 0;
+    }
+
+    // A preallocated (or previously received) file may be larger than the received content
+    if ((options & OPT_MANIFEST) && ftruncate(write_fd, file_size) == -1) {
+        perror_exit("receive: ftruncate");
     }
     printf("File received successfully\n\n");
 
+    // A relay can now serve the file onward
+    if (relay) {
+        relay_landed(relay, b_buffer);
+    }
+
     // Cleanup (set static buffers to 0)
+    free(content);
     close(write_fd);
     memset(buffer, 0, BUFFER_SIZE);
     memset(b_buffer, 0, BUFFER_SIZE);
 
-    return 0;
+    return file_size;
+}
+
+Manifest receive_manifest(int socket, char* dirpath) {
+    // Read the manifest's length and send response
+    char buffer[MAX_REPR];
+    memset(buffer, 0, MAX_REPR);
+    if (read(socket, buffer, MAX_REPR) <= 0) {
+        perror_exit("receive_manifest: read");
+    }
+    size_t len = strtoull(buffer, NULL, 10);
+    if (write(socket, "ML READ", ACK_LEN) == -1) {
+        perror_exit("receive_manifest: write");
+    }
+
+    // Read the manifest itself (never past its end, the first file follows it)
+    char* blob = malloc(len + 1);
+    size_t received = 0;
+    while (received < len) {
+        ssize_t bytes = read(socket, blob + received, len - received);
+        if (bytes <= 0) {
+            perror_exit("receive_manifest: read");
+        }
+        received += bytes;
+    }
+    Manifest manifest = manifest_decode(blob, len);
+    free(blob);
+    if (!manifest) {
+        fprintf(stderr, "receive_manifest: malformed manifest\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Create the directory skeleton in one pass (a directory is listed before its content)
+    // and preallocate every file, so that its blocks are allocated contiguously before any content arrives
+    char path[BUFFER_SIZE];
+    for (int i = 0; i < manifest->count; i++) {
+        struct manifest_entry* entry = &manifest->entries[i];
+        snprintf(path, BUFFER_SIZE, "%s%s", dirpath, entry->path);
+        if (entry->type == ENTRY_DIR) {
+            recursive_mkdir(path);
+            continue;
+        }
+        // A file left read-only by an earlier clone (its source mode) is replaced, as receive does
+        if (file_exists(path) && access(path, W_OK) && remove(path)) {
+            perror("receive_manifest: remove");
+            continue;
+        }
+        // Preallocation is only an optimization: a file that cannot be created here is left to receive
+        int fd = open(path, O_CREAT | O_WRONLY, FILE_PERMS);
+        if (fd == -1) {
+            perror("receive_manifest: open");
+            continue;
+        }
+        if (entry->size > 0 && fallocate(fd, 0, 0, entry->size) == -1 && errno != EOPNOTSUPP) {
+            perror("receive_manifest: fallocate");
+        }
+        close(fd);
+    }
+    printf("Manifest: %d files, %d directories, %lld bytes\n", manifest->no_files, manifest->count - manifest->no_files,
+           (long long) manifest->total_bytes);
+
+    // Send response
+    if (write(socket, "MF READ", ACK_LEN) == -1) {
+        perror_exit("receive_manifest: write");
+    }
+    return manifest;
+}
+
+void apply_metadata(Manifest manifest, char* dirpath) {
+    // Files first and then the directories, deepest first, so that creating or changing an entry does not touch a directory after its time was set
+    char path[BUFFER_SIZE];
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = manifest->count - 1; i >= 0; i--) {
+            struct manifest_entry* entry = &manifest->entries[i];
+            if ((entry->type == ENTRY_DIR) != pass) {
+                continue;
+            }
+            snprintf(path, BUFFER_SIZE, "%s%s", dirpath, entry->path);
+            struct timespec times[2] = { { .tv_nsec = UTIME_OMIT }, entry->mtime };
+            if (chmod(path, entry->mode) == -1 || utimensat(AT_FDCWD, path, times, 0) == -1) {
+                perror("apply_metadata");
+            }
+        }
+    }
+}
+
+
+void receive_changes(int socket, char* dirpath, int block_size, int options) {
+    char buffer[2 * BUFFER_SIZE];
+    char path[BUFFER_SIZE], new_path[BUFFER_SIZE];
+    ssize_t bytes;
+    while (1) {
+        // Read the next change, the server closes the connection when it stops watching
+        memset(buffer, 0, sizeof(buffer));
+        bytes = read(socket, buffer, sizeof(buffer) - 1);
+        if (bytes == -1) {
+            perror_exit("receive_changes: read");
+        }
+        else if (bytes == 0) {
+            return;
+        }
+        char type = buffer[0];
+        if (snprintf(path, sizeof(path), "%s%s", dirpath, buffer + 2) >= (int) sizeof(path)
+            || snprintf(new_path, sizeof(new_path), "%s%s", dirpath, buffer + strlen(buffer) + 1) >= (int) sizeof(new_path)) {
+            fprintf(stderr, "receive_changes: path is too long\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // Send response
+        bytes = write(socket, "EV READ", ACK_LEN);
+        if (bytes == -1) {
+            perror_exit("receive_changes: write");
+        }
+
+        // Apply the change - a failed delete or rename only means the entry was already out of date
+        switch (type) {
+        case 'M':
+            receive(socket, dirpath, block_size, options);
+            break;
+        case 'D':
+            printf("Deleted: %s\n", path);
+            if (recursive_remove(path) && errno != ENOENT) {
+                perror("receive_changes: remove");
+            }
+            break;
+        case 'R': {
+            printf("Renamed: %s -> %s\n", path, new_path);
+            char parent[BUFFER_SIZE];
+            snprintf(parent, sizeof(parent), "%s", new_path);
+            recursive_mkdir(dirname(parent));
+            if (rename(path, new_path)) {
+                perror("receive_changes: rename");
+            }
+            break;
+        }
+        default:
+            fprintf(stderr, "receive_changes: unknown change '%c'\n", type);
+            exit(EXIT_FAILURE);
+        }
+    }
 }
 
 
@@ -377,25 +1783,138 @@ void* process(void* arg) {
         perror_thr("process: pthread_detach", pthread_self());
     }
     while (1) {
-        // If the queue is empty wait
+        // Wait until a queued file's session has no file in the hands of another worker - a worker above the pool's
+        // minimum exits once it has been idle for too long
         pthread_mutex_lock(&queue_mutex);
-        while (queue->free_slots == queue->size) {
-            pthread_cond_wait(&queue_non_empty, &queue_mutex);
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += POOL_IDLE_TIMEOUT_S;
+        pool_idle++;
+        int k;
+        while ((k = next_runnable()) == -1) {
+            if (pool_size <= pool_min) {
+                pthread_cond_wait(&queue_non_empty, &queue_mutex);
+            }
+            else if (pthread_cond_timedwait(&queue_non_empty, &queue_mutex, &deadline) == ETIMEDOUT
+                     && next_runnable() == -1 && pool_size > pool_min) {
+                pool_idle--;
+                pool_size--;
+                report_pool("idle worker exited");
+                pthread_mutex_unlock(&queue_mutex);
+                return NULL;
+            }
         }
+        pool_idle--;
 
-        // Get file_info and broadcast that the queue is no longer full - if no threads were blocked, broadcast will have no effect
-        FileInfo file_info = get_first(queue);
+        // Take the file (its session is now busy, so only this worker sends to the client) and broadcast that the queue
+        // is no longer full - if no threads were blocked, broadcast will have no effect
+        FileInfo file_info = remove_file_info(queue, k);
+        Session session = file_info->session;
+        session->busy = 1;
         pthread_cond_broadcast(&queue_non_full);
+
+        // Grow the pool if the file waited too long in the queue, no worker is idle and another queued file could
+        // be sent right away (a file that only waited for its own client's previous files is no reason to grow)
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double waited = elapsed_ms(&file_info->queued, &now);
+        if (pool_idle == 0 && waited > POOL_GROW_WAIT_MS && next_runnable() != -1 && pool_size < pool_max) {
+            char reason[MAX_REPR];
+            snprintf(reason, MAX_REPR, "queue wait %.0f ms", waited);
+            add_worker(reason);
+        }
+
+        // If the prefetch thread is still opening the file, wait for it to finish
+        while (file_info->prefetch_state == PREFETCH_BUSY) {
+            pthread_cond_wait(&prefetch_done, &queue_mutex);
+        }
+        pthread_mutex_unlock(&queue_mutex);
+
+        // Send the file (once a transfer has failed the session's remaining files are released without being sent)
+        trace_span(session->trace, "queue wait", file_info->filepath, trace_time(&file_info->queued), trace_time(&now));
+        int failed = session_failed(session);
+        if (!failed) {
+            printf("[Worker Thread] %ld]: sending file %s to socket %d\n", pthread_self(), file_info->filepath, file_info->socket_fd);
+            if (send_file(file_info) == -1) {
+                fprintf(stderr, "[Worker Thread %ld]: could not send %s, dropping client socket %d\n", pthread_self(), file_info->filepath, file_info->socket_fd);
+                fail_session(session);
+                failed = 1;
+            }
+        }
+
+        // Let a worker take the session's next file
+        pthread_mutex_lock(&queue_mutex);
+        session->busy = 0;
+        pthread_cond_signal(&queue_non_empty);
         pthread_mutex_unlock(&queue_mutex);
 
-        // Lock client's mutex so that only one worker can send a file to the client each time
-        pthread_mutex_lock(file_info->mutex);
-        printf("[Worker Thread] %ld]: sending file %s to socket %d\n", pthread_self(), file_info->filepath, file_info->socket_fd);
-        send_file(file_info);
-        pthread_mutex_unlock(file_info->mutex);
+        // Release the file - the last reference closes fd and frees client's session, so that the fd cannot be
+        // reused by a new connection while other files of the session are still queued
+        // (in watch mode the communication thread keeps its reference and takes over the socket)
+        if (release_session(session)) {
+            printf("[Worker Thread %ld]: %s, closing client socket %d\n", pthread_self(), failed ? "transfer failed" : "all files sent", file_info->socket_fd);
+            close_session(session, file_info->socket_fd);
+        }
+
+        // Return the warmed bytes to the prefetch budget
+        if (file_info->warmed) {
+            pthread_mutex_lock(&queue_mutex);
+            prefetch_bytes -= file_info->warmed;
+            pthread_cond_signal(&queue_prefetch);
+            pthread_mutex_unlock(&queue_mutex);
+        }
 
         // Cleanup
         destroy_file_info(file_info);
     }
     return NULL;
 }
+
+// Find the first of the next prefetch_depth queued file infos that has not been prefetched (queue_mutex must be held)
+static FileInfo next_to_prefetch(void) {
+    FileInfo file_info;
+    for (int k = 0; k < prefetch_depth && (file_info = peek_file_info(queue, k)); k++) {
+        if (file_info->prefetch_state == PREFETCH_NONE) {
+            return file_info;
+        }
+    }
+    return NULL;
+}
+
+void* prefetch(void* arg) {
+    // Detach prefetch thread - we do not need to join
+    if (pthread_detach(pthread_self())) {
+        perror_thr("prefetch: pthread_detach", pthread_self());
+    }
+    pthread_mutex_lock(&queue_mutex);
+    while (1) {
+        // Wait until one of the upcoming files has not been prefetched and there is budget left
+        FileInfo file_info;
+        while ((file_info = next_to_prefetch()) == NULL || prefetch_bytes >= prefetch_budget) {
+            pthread_cond_wait(&queue_prefetch, &queue_mutex);
+        }
+        file_info->prefetch_state = PREFETCH_BUSY;
+        off_t budget = prefetch_budget - prefetch_bytes;
+        pthread_mutex_unlock(&queue_mutex);
+
+        // Open and stat the file and ask the kernel to read ahead as much of it as the budget allows
+        // (the file info cannot be destroyed meanwhile, since workers wait for PREFETCH_BUSY to clear)
+        off_t warmed = 0;
+        struct stat s;
+        int read_fd = open(file_info->filepath, O_RDONLY);
+        if (read_fd >= 0 && fstat(read_fd, &s) == 0) {
+            warmed = (s.st_size < budget) ? s.st_size : budget;
+            posix_fadvise(read_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            posix_fadvise(read_fd, 0, warmed, POSIX_FADV_WILLNEED);
+        }
+
+        // Hand the opened file over to the worker that is going to send it
+        pthread_mutex_lock(&queue_mutex);
+        file_info->read_fd = read_fd;
+        file_info->warmed = warmed;
+        file_info->prefetch_state = PREFETCH_DONE;
+        prefetch_bytes += warmed;
+        pthread_cond_broadcast(&prefetch_done);
+    }
+    return NULL;
+}
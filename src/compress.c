@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "compress.h"
+
+// Extensions of formats that are already compressed
+static const char* compressed_extensions[] = {
+    "gz", "tgz", "bz2", "xz", "txz", "zst", "lz4", "lzma", "br", "z", "zip", "7z", "rar", "jar", "war", "whl", "apk",
+    "deb", "rpm", "jpg", "jpeg", "png", "gif", "webp", "heic", "avif", "mp3", "mp4", "m4a", "m4v", "mkv", "mov", "avi",
+    "webm", "ogg", "opus", "flac", "pdf", "woff", "woff2", "pack", NULL
+};
+
+
+Compressor create_compressor(int block_size) {
+    Compressor compressor = malloc(sizeof(*compressor));
+    memset(&compressor->stream, 0, sizeof(z_stream));
+
+    // Raw deflate: the frames carry the lengths and the checksums (if any) cover the raw bytes
+    if (deflateInit2(&compressor->stream, COMPRESS_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(compressor);
+        return NULL;
+    }
+    compressor->out_size = sizeof(struct frame_header) + deflateBound(&compressor->stream, block_size) + 16;
+    compressor->out = malloc(compressor->out_size);
+    return compressor;
+}
+
+// Check the file's extension against the known compressed formats
+static int compressed_extension(const char* path) {
+    const char* name = strrchr(path, '/');
+    const char* dot = strrchr(name ? name : path, '.');
+    if (!dot) {
+        return 0;
+    }
+    for (int i = 0; compressed_extensions[i]; i++) {
+        if (!strcasecmp(dot + 1, compressed_extensions[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int compress_worth(Compressor compressor, int fd, const char* path, off_t size) {
+    if (size < COMPRESS_MIN_SIZE || compressed_extension(path)) {
+        return 0;
+    }
+
+    // Compress a sample of the file in one go and look at the ratio
+    size_t len = (size < COMPRESS_SAMPLE) ? (size_t) size : COMPRESS_SAMPLE;
+    unsigned char* sample = malloc(len);
+    ssize_t bytes = pread(fd, sample, len, 0);
+    if (bytes <= 0) {
+        free(sample);
+        return 0;
+    }
+    z_stream* stream = &compressor->stream;
+    uLong bound = deflateBound(stream, bytes);
+    unsigned char* out = malloc(bound);
+    stream->next_in = sample;
+    stream->avail_in = bytes;
+    stream->next_out = out;
+    stream->avail_out = bound;
+    int error = deflate(stream, Z_FINISH);
+    size_t compressed = bound - stream->avail_out;
+    deflateReset(stream);
+    free(out);
+    free(sample);
+    return error == Z_STREAM_END && compressed < bytes * COMPRESS_MAX_RATIO;
+}
+
+void compressor_reset(Compressor compressor) {
+    deflateReset(&compressor->stream);
+}
+
+ssize_t compress_block(Compressor compressor, const void* data, size_t len) {
+    z_stream* stream = &compressor->stream;
+    stream->next_in = (unsigned char*) data;
+    stream->avail_in = len;
+    size_t have = sizeof(struct frame_header);
+    while (1) {
+        stream->next_out = compressor->out + have;
+        stream->avail_out = compressor->out_size - have;
+        int error = deflate(stream, Z_SYNC_FLUSH);
+        if (error != Z_OK && error != Z_BUF_ERROR) {
+            return -1;
+        }
+        have = compressor->out_size - stream->avail_out;
+
+        // The block has been flushed once deflate leaves room in the output
+        if (stream->avail_out > 0) {
+            return have - sizeof(struct frame_header);
+        }
+        compressor->out_size *= 2;
+        compressor->out = realloc(compressor->out, compressor->out_size);
+    }
+}
+
+void destroy_compressor(Compressor compressor) {
+    if (!compressor) {
+        return;
+    }
+    deflateEnd(&compressor->stream);
+    free(compressor->out);
+    free(compressor);
+}
+
+
+Decompressor create_decompressor(int block_size) {
+    Decompressor decompressor = malloc(sizeof(*decompressor));
+    memset(&decompressor->stream, 0, sizeof(z_stream));
+    if (inflateInit2(&decompressor->stream, -MAX_WBITS) != Z_OK) {
+        free(decompressor);
+        return NULL;
+    }
+    decompressor->in_size = compressBound(block_size) + 64;
+    decompressor->in = malloc(decompressor->in_size);
+    return decompressor;
+}
+
+void decompressor_reset(Decompressor decompressor) {
+    inflateReset(&decompressor->stream);
+}
+
+int decompress_block(Decompressor decompressor, size_t comp_len, void* out, size_t raw_len) {
+    z_stream* stream = &decompressor->stream;
+    stream->next_in = decompressor->in;
+    stream->avail_in = comp_len;
+    stream->next_out = out;
+    stream->avail_out = raw_len;
+
+    // Once out is full the rest of the input must be the (empty) flush marker: inflate it into a spare byte,
+    // which must stay unused
+    unsigned char spare;
+    int spare_used = 0;
+    while (stream->avail_in > 0) {
+        if (stream->avail_out == 0) {
+            if (spare_used) {
+                return -1;
+            }
+            stream->next_out = &spare;
+            stream->avail_out = 1;
+            spare_used = 1;
+        }
+        uInt avail_in = stream->avail_in, avail_out = stream->avail_out;
+        int error = inflate(stream, Z_SYNC_FLUSH);
+        if (error != Z_OK && error != Z_BUF_ERROR) {
+            return -1;
+        }
+        if (stream->avail_in == avail_in && stream->avail_out == avail_out) {
+            return -1;      // no progress: truncated frame
+        }
+    }
+    if (spare_used) {
+        return (stream->avail_out == 1) ? 0 : -1;
+    }
+    return (stream->avail_out == 0) ? 0 : -1;
+}
+
+void destroy_decompressor(Decompressor decompressor) {
+    if (!decompressor) {
+        return;
+    }
+    inflateEnd(&decompressor->stream);
+    free(decompressor->in);
+    free(decompressor);
+}
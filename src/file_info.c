@@ -1,21 +1,29 @@
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "file_info.h"
 
 
-FileInfo create_file_info(int fd, int bs, char* file_path, pthread_mutex_t* client_mutex) {
+FileInfo create_file_info(int fd, int bs, int options, char* file_path, Session session) {
     FileInfo file_info = malloc(sizeof(*file_info));
     file_info->socket_fd = fd;
     file_info->block_size = bs;
+    file_info->options = options;
     file_info->filepath = malloc(sizeof(char) * (strlen(file_path) + 1));
     strcpy(file_info->filepath, file_path);
-    file_info->mutex = client_mutex;
+    file_info->session = session;
+    file_info->prefetch_state = PREFETCH_NONE;
+    file_info->read_fd = -1;
+    file_info->warmed = 0;
     return file_info;
 }
 
 void destroy_file_info(FileInfo file_info) {
-    file_info->mutex = NULL;
+    file_info->session = NULL;
+    if (file_info->read_fd >= 0) {
+        close(file_info->read_fd);
+    }
     free(file_info->filepath);
     free(file_info);
 }
\ No newline at end of file
@@ -0,0 +1,377 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+
+// Glob token types
+#define TOKEN_CHAR  0
+#define TOKEN_ANY   1   // '?'
+#define TOKEN_STAR  2   // '*'
+#define TOKEN_CLASS 3   // [...]
+
+
+static struct trie_node* create_node(char c) {
+    struct trie_node* node = calloc(1, sizeof(*node));
+    node->c = c;
+    return node;
+}
+
+static void destroy_trie(struct trie_node* node) {
+    while (node) {
+        struct trie_node* sibling = node->sibling;
+        destroy_trie(node->child);
+        free(node);
+        node = sibling;
+    }
+}
+
+// Insert the literal (read backwards if reverse) and return the node it ends at
+static struct trie_node* trie_insert(struct trie_node** root, const char* s, size_t len, int reverse) {
+    if (!*root) {
+        *root = create_node('\0');
+    }
+    struct trie_node* node = *root;
+    for (size_t i = 0; i < len; i++) {
+        char c = reverse ? s[len - 1 - i] : s[i];
+        struct trie_node* child = node->child;
+        while (child && child->c != c) {
+            child = child->sibling;
+        }
+        if (!child) {
+            child = create_node(c);
+            child->sibling = node->child;
+            node->child = child;
+        }
+        node = child;
+    }
+    return node;
+}
+
+// Check if a pattern of the trie matches s (read backwards if reverse)
+// A "<literal>*" pattern matches if the rest of s does not cross a directory
+static int trie_match(struct trie_node* node, const char* s, size_t len, int reverse, unsigned char type) {
+    for (size_t i = 0; node; i++) {
+        if ((node->prefix & type) && (reverse || !memchr(s + i, '/', len - i))) {
+            return 1;
+        }
+        if (i == len) {
+            return (node->exact & type) != 0;
+        }
+        char c = reverse ? s[len - 1 - i] : s[i];
+        for (node = node->child; node && node->c != c; node = node->sibling);
+    }
+    return 0;
+}
+
+// Compile the pattern into glob tokens, returns -1 if a class is not terminated
+static int compile_glob(struct glob* glob, const char* pattern, size_t len) {
+    glob->tokens = malloc(sizeof(struct glob_token) * (len + 1));
+    glob->no_tokens = 0;
+    for (size_t i = 0; i < len; i++) {
+        struct glob_token* token = &glob->tokens[glob->no_tokens++];
+        token->set = NULL;
+        if (pattern[i] == '*') {
+            token->type = TOKEN_STAR;
+            // Consecutive stars are the same as one
+            while (i + 1 < len && pattern[i + 1] == '*') {
+                i++;
+            }
+        }
+        else if (pattern[i] == '?') {
+            token->type = TOKEN_ANY;
+        }
+        else if (pattern[i] == '[') {
+            token->type = TOKEN_CLASS;
+            token->set = calloc(256, 1);
+            size_t j = i + 1;
+            int negate = (j < len && (pattern[j] == '!' || pattern[j] == '^'));
+            j += negate;
+            // A ']' right after the opening bracket is part of the class
+            for (size_t first = j; j < len && (pattern[j] != ']' || j == first); j++) {
+                unsigned char from = pattern[j], to = from;
+                if (j + 2 < len && pattern[j + 1] == '-' && pattern[j + 2] != ']') {
+                    to = pattern[j + 2];
+                    j += 2;
+                }
+                for (int c = from; c <= to; c++) {
+                    token->set[c] = 1;
+                }
+            }
+            if (j >= len) {
+                return -1;
+            }
+            if (negate) {
+                for (int c = 0; c < 256; c++) {
+                    token->set[c] = !token->set[c];
+                }
+            }
+            i = j;
+        }
+        else {
+            token->type = TOKEN_CHAR;
+            if (pattern[i] == '\\' && i + 1 < len) {
+                i++;
+            }
+            token->c = pattern[i];
+        }
+    }
+    return 0;
+}
+
+static void destroy_glob(struct glob* glob) {
+    for (int i = 0; i < glob->no_tokens; i++) {
+        free(glob->tokens[i].set);
+    }
+    free(glob->tokens);
+}
+
+// Simulate the glob's automaton on s: state i means that the first i tokens have been matched
+// (linear in the length of s for every state, no backtracking)
+static int glob_match(struct glob* glob, const char* s) {
+    int n = glob->no_tokens;
+    unsigned char active[n + 1], next[n + 1];
+    memset(active, 0, n + 1);
+    active[0] = 1;
+    for (int i = 0; i < n && active[i] && glob->tokens[i].type == TOKEN_STAR; i++) {
+        active[i + 1] = 1;
+    }
+    for (; *s; s++) {
+        unsigned char c = *s;
+        int alive = 0;
+        memset(next, 0, n + 1);
+        for (int i = 0; i < n; i++) {
+            if (!active[i]) {
+                continue;
+            }
+            struct glob_token* token = &glob->tokens[i];
+            switch (token->type) {
+            case TOKEN_STAR:
+                if (c != '/') {
+                    next[i] = alive = 1;
+                }
+                break;
+            case TOKEN_ANY:
+                if (c != '/') {
+                    next[i + 1] = alive = 1;
+                }
+                break;
+            case TOKEN_CLASS:
+                if (c != '/' && token->set[c]) {
+                    next[i + 1] = alive = 1;
+                }
+                break;
+            default:
+                if (token->c == (char) c) {
+                    next[i + 1] = alive = 1;
+                }
+            }
+        }
+        if (!alive) {
+            return 0;
+        }
+        // A star can also match nothing
+        for (int i = 0; i < n; i++) {
+            if (next[i] && glob->tokens[i].type == TOKEN_STAR) {
+                next[i + 1] = 1;
+            }
+        }
+        memcpy(active, next, n + 1);
+    }
+    return active[n];
+}
+
+// Add the pattern to the rules, choosing the cheapest structure that can match it
+static int add_rule(struct rules* rules, const char* pattern) {
+    size_t len = strlen(pattern);
+    int path = 0;
+    unsigned char types = FILTER_FILE | FILTER_DIR;
+
+    // A leading '/' anchors the pattern at the root, a trailing '/' restricts it to directories
+    if (len > 0 && pattern[0] == '/') {
+        path = 1;
+        pattern++;
+        len--;
+    }
+    if (len > 0 && pattern[len - 1] == '/') {
+        types = FILTER_DIR;
+        len--;
+    }
+    if (len == 0) {
+        return -1;
+    }
+    if (memchr(pattern, '/', len)) {
+        path = 1;
+    }
+
+    // Find the wildcards of the pattern
+    int wildcards = 0;
+    size_t star = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (pattern[i] == '*') {
+            wildcards++;
+            star = i;
+        }
+        else if (pattern[i] == '?' || pattern[i] == '[' || pattern[i] == '\\') {
+            wildcards += 2;
+        }
+    }
+
+    if (wildcards == 0) {
+        trie_insert(path ? &rules->paths : &rules->names, pattern, len, 0)->exact |= types;
+    }
+    else if (wildcards == 1 && star == len - 1) {
+        trie_insert(path ? &rules->paths : &rules->names, pattern, len - 1, 0)->prefix |= types;
+    }
+    else if (wildcards == 1 && star == 0 && !path) {
+        trie_insert(&rules->suffixes, pattern + 1, len - 1, 1)->prefix |= types;
+    }
+    else {
+        struct glob glob;
+        glob.path = path;
+        glob.types = types;
+        if (compile_glob(&glob, pattern, len) == -1) {
+            destroy_glob(&glob);
+            return -1;
+        }
+        rules->globs = realloc(rules->globs, sizeof(struct glob) * (rules->no_globs + 1));
+        rules->globs[rules->no_globs++] = glob;
+    }
+    rules->count++;
+    return 0;
+}
+
+static int rules_match(struct rules* rules, const char* relative, unsigned char type) {
+    if (rules->count == 0) {
+        return 0;
+    }
+    const char* base = strrchr(relative, '/');
+    base = base ? base + 1 : relative;
+    size_t base_len = strlen(base);
+    if (trie_match(rules->names, base, base_len, 0, type) || trie_match(rules->suffixes, base, base_len, 1, type)
+        || trie_match(rules->paths, relative, strlen(relative), 0, type)) {
+        return 1;
+    }
+    for (int i = 0; i < rules->no_globs; i++) {
+        struct glob* glob = &rules->globs[i];
+        if ((glob->types & type) && glob_match(glob, glob->path ? relative : base)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void destroy_rules(struct rules* rules) {
+    destroy_trie(rules->names);
+    destroy_trie(rules->paths);
+    destroy_trie(rules->suffixes);
+    for (int i = 0; i < rules->no_globs; i++) {
+        destroy_glob(&rules->globs[i]);
+    }
+    free(rules->globs);
+}
+
+Filter create_filter(const char* root) {
+    Filter filter = calloc(1, sizeof(*filter));
+    filter->root = strdup(root);
+    return filter;
+}
+
+int filter_add(Filter filter, int exclude, const char* pattern) {
+    return add_rule(exclude ? &filter->exclude : &filter->include, pattern);
+}
+
+int filter_active(Filter filter) {
+    return filter->include.count + filter->exclude.count > 0;
+}
+
+// Check if one of the parent directories of the path matches an include rule
+// The answer for the last directory is kept, since the files of a directory are checked one after the other
+static int parent_included(Filter filter, const char* relative) {
+    const char* base = strrchr(relative, '/');
+    if (!base) {
+        return 0;
+    }
+    size_t len = base - relative;
+    if (filter->parent && filter->parent_len == len && !memcmp(filter->parent, relative, len)) {
+        return filter->parent_included;
+    }
+    filter->parent = realloc(filter->parent, len + 1);
+    memcpy(filter->parent, relative, len);
+    filter->parent[len] = '\0';
+    filter->parent_len = len;
+    filter->parent_included = 0;
+
+    // Check the directory and each of its parents (the prefixes that end before a '/')
+    for (size_t i = 1; i <= len && !filter->parent_included; i++) {
+        if (i == len || filter->parent[i] == '/') {
+            char c = filter->parent[i];
+            filter->parent[i] = '\0';
+            filter->parent_included = rules_match(&filter->include, filter->parent, FILTER_DIR);
+            filter->parent[i] = c;
+        }
+    }
+    return filter->parent_included;
+}
+
+// Same as filter_excluded, for a path relative to the root
+static int excluded(Filter filter, const char* relative, int is_dir) {
+    unsigned char type = is_dir ? FILTER_DIR : FILTER_FILE;
+    if (rules_match(&filter->exclude, relative, type)) {
+        return 1;
+    }
+
+    // Include rules select files, directories are always descended into
+    // A directory that matches an include rule includes its whole subtree
+    if (is_dir || filter->include.count == 0 || rules_match(&filter->include, relative, type)) {
+        return 0;
+    }
+    return !parent_included(filter, relative);
+}
+
+// Path relative to the filter's root
+static const char* relative_path(Filter filter, const char* path) {
+    const char* relative = path;
+    if (!strncmp(path, filter->root, strlen(filter->root))) {
+        relative += strlen(filter->root);
+    }
+    while (*relative == '/') {
+        relative++;
+    }
+    return relative;
+}
+
+int filter_excluded(Filter filter, const char* path, int is_dir) {
+    if (!filter_active(filter)) {
+        return 0;
+    }
+    return excluded(filter, relative_path(filter, path), is_dir);
+}
+
+int filter_path_excluded(Filter filter, const char* path, int is_dir) {
+    if (!filter_active(filter)) {
+        return 0;
+    }
+    char* relative = strdup(relative_path(filter, path));
+    int result = 0;
+    for (char* slash = strchr(relative, '/'); slash && !result; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        result = excluded(filter, relative, 1);
+        *slash = '/';
+    }
+    if (!result) {
+        result = excluded(filter, relative, is_dir);
+    }
+    free(relative);
+    return result;
+}
+
+void destroy_filter(Filter filter) {
+    if (!filter) {
+        return;
+    }
+    destroy_rules(&filter->include);
+    destroy_rules(&filter->exclude);
+    free(filter->parent);
+    free(filter->root);
+    free(filter);
+}
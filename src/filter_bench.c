@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "filter.h"
+
+#define DEFAULT_PATHS   2000000
+#define MAX_DEPTH       8
+#define MAX_ENTRIES     40      // entries of a generated directory
+#define MAX_GLOBS       64
+
+static const char* dir_names[] = {
+    "src", "include", "lib", "build", "test", "tests", "docs", "node_modules", ".git", "vendor", "third_party",
+    "objects", "out", "tools", "scripts", "core", "util", "net", "fs", "drivers", "arch", "kernel", NULL
+};
+static const char* extensions[] = {
+    "c", "h", "cpp", "hpp", "o", "a", "so", "py", "js", "json", "md", "txt", "log", "tmp", "png", "gz", "", NULL
+};
+
+// Rule sets benchmarked when no globs are given
+static const char* default_sets[][8] = {
+    { "E:.git", "E:node_modules/", "E:*.o", "E:*.tmp", NULL },
+    { "I:*.c", "I:*.h", "E:build/", "E:*test*", NULL },
+    { "I:src/", "I:/include", "E:*.o", NULL },
+    { "I:src/*/[a-m]*.c", "I:*/net/*.h", "E:*.[oa]", "E:vendor/*", "E:?out", NULL },
+};
+
+static int count(const char** array) {
+    int n = 0;
+    while (array[n]) {
+        n++;
+    }
+    return n;
+}
+
+// Pick a random directory under root (deterministic for a given seed)
+static void random_dir(char* dir, const char* root, unsigned int* seed) {
+    int no_dirs = count(dir_names);
+    int depth = rand_r(seed) % MAX_DEPTH;
+    int len = sprintf(dir, "%s", root);
+    for (int i = 0; i < depth; i++) {
+        len += sprintf(dir + len, "/%s", dir_names[rand_r(seed) % no_dirs]);
+    }
+}
+
+// Build a random entry of the directory
+static void random_entry(char* path, const char* dir, unsigned int* seed, int* is_dir) {
+    *is_dir = (rand_r(seed) % 8 == 0);
+    if (*is_dir) {
+        sprintf(path, "%s/%s%d", dir, dir_names[rand_r(seed) % count(dir_names)], rand_r(seed) % 100);
+    }
+    else {
+        const char* extension = extensions[rand_r(seed) % count(extensions)];
+        sprintf(path, "%s/file_%d%s%s", dir, rand_r(seed) % 10000, *extension ? "." : "", extension);
+    }
+}
+
+static double elapsed(const struct timespec* start, const struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Time filter_excluded over the paths with the given rules ("I:<glob>" or "E:<glob>")
+static void bench(const char** rules, int no_rules, char** paths, int* dirs, int no_paths) {
+    Filter filter = create_filter("/bench");
+    for (int i = 0; i < no_rules; i++) {
+        printf("%s%s", i ? " " : "", rules[i]);
+        if (filter_add(filter, rules[i][0] == 'E', rules[i] + 2) == -1) {
+            printf(": invalid glob\n");
+            destroy_filter(filter);
+            return;
+        }
+    }
+    struct timespec start, end;
+    int no_excluded = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < no_paths; i++) {
+        no_excluded += filter_excluded(filter, paths[i], dirs[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = elapsed(&start, &end);
+    printf("\n  %d paths, %d excluded: %.3f s, %.1f ns/path, %.2f M paths/s\n",
+           no_paths, no_excluded, seconds, seconds * 1e9 / no_paths, no_paths / seconds / 1e6);
+    destroy_filter(filter);
+}
+
+/// Usage: ./bin/filterBench [-n <paths>] [-I <include_glob>]... [-E <exclude_glob>]...
+int main(int argc, char* argv[]) {
+    int no_paths = DEFAULT_PATHS;
+    const char* rules[MAX_GLOBS];
+    int no_rules = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            no_paths = atoi(argv[++i]);
+        }
+        else if ((!strcmp(argv[i], "-I") || !strcmp(argv[i], "-E")) && i + 1 < argc && no_rules < MAX_GLOBS) {
+            char* rule = malloc(strlen(argv[i + 1]) + 3);
+            sprintf(rule, "%c:%s", argv[i][1], argv[i + 1]);
+            rules[no_rules++] = rule;
+            i++;
+        }
+        else {
+            fprintf(stderr, "Usage: %s [-n <paths>] [-I <include_glob>]... [-E <exclude_glob>]...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (no_paths <= 0) {
+        fprintf(stderr, "%s: invalid number of paths\n", argv[0]);
+        return 1;
+    }
+
+    // Generate the paths up front, so that only the matcher is timed
+    // The entries of a directory are consecutive, as they are when a directory is scanned
+    char** paths = malloc(sizeof(char*) * no_paths);
+    int* dirs = malloc(sizeof(int) * no_paths);
+    unsigned int seed = 1;
+    char dir[512], path[1024];
+    for (int i = 0, left = 0; i < no_paths; i++, left--) {
+        if (left == 0) {
+            random_dir(dir, "/bench", &seed);
+            left = 1 + rand_r(&seed) % MAX_ENTRIES;
+        }
+        random_entry(path, dir, &seed, &dirs[i]);
+        paths[i] = strdup(path);
+    }
+
+    if (no_rules > 0) {
+        bench(rules, no_rules, paths, dirs, no_paths);
+        for (int i = 0; i < no_rules; i++) {
+            free((char*) rules[i]);
+        }
+    }
+    else {
+        for (size_t i = 0; i < sizeof(default_sets) / sizeof(default_sets[0]); i++) {
+            bench(default_sets[i], count(default_sets[i]), paths, dirs, no_paths);
+        }
+    }
+
+    for (int i = 0; i < no_paths; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    free(dirs);
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "manifest.h"
+
+
+Manifest create_manifest(void) {
+    Manifest manifest = malloc(sizeof(*manifest));
+    manifest->entries = NULL;
+    manifest->count = manifest->capacity = 0;
+    manifest->no_files = 0;
+    manifest->total_bytes = 0;
+    return manifest;
+}
+
+// Append an entry (the path is copied)
+static void append(Manifest manifest, char type, mode_t mode, off_t size, struct timespec mtime, const char* path) {
+    if (manifest->count == manifest->capacity) {
+        manifest->capacity = manifest->capacity ? manifest->capacity * 2 : 64;
+        manifest->entries = realloc(manifest->entries, sizeof(struct manifest_entry) * manifest->capacity);
+    }
+    struct manifest_entry* entry = &manifest->entries[manifest->count++];
+    entry->type = type;
+    entry->mode = mode & 07777;
+    entry->size = (type == ENTRY_FILE) ? size : 0;
+    entry->mtime = mtime;
+    entry->path = strdup(path);
+    if (type == ENTRY_FILE) {
+        manifest->no_files++;
+        manifest->total_bytes += size;
+    }
+}
+
+void manifest_add(Manifest manifest, char type, const char* path, const struct stat* s) {
+    append(manifest, type, s->st_mode, s->st_size, s->st_mtim, path);
+}
+
+static int by_path(const void* a, const void* b) {
+    return strcmp(((const struct manifest_entry*) a)->path, ((const struct manifest_entry*) b)->path);
+}
+
+void manifest_sort(Manifest manifest) {
+    qsort(manifest->entries, manifest->count, sizeof(struct manifest_entry), by_path);
+}
+
+char* manifest_encode(Manifest manifest, size_t* len) {
+    size_t capacity = 0;
+    for (int i = 0; i < manifest->count; i++) {
+        capacity += strlen(manifest->entries[i].path) + 80;
+    }
+    char* blob = malloc(capacity + 1);
+    *len = 0;
+    for (int i = 0; i < manifest->count; i++) {
+        struct manifest_entry* entry = &manifest->entries[i];
+        *len += sprintf(blob + *len, "%c %o %lld %lld.%09ld %s", entry->type, (unsigned) entry->mode, (long long) entry->size,
+                        (long long) entry->mtime.tv_sec, entry->mtime.tv_nsec, entry->path) + 1;
+    }
+    return blob;
+}
+
+Manifest manifest_decode(const char* blob, size_t len) {
+    Manifest manifest = create_manifest();
+    size_t offset = 0;
+    while (offset < len) {
+        // Every record must be terminated inside the blob
+        const char* record = blob + offset;
+        const char* end = memchr(record, '\0', len - offset);
+        char type;
+        unsigned mode;
+        long long size, sec;
+        long nsec;
+        int path_offset;
+        if (!end || sscanf(record, "%c %o %lld %lld.%ld %n", &type, &mode, &size, &sec, &nsec, &path_offset) != 5
+            || (type != ENTRY_FILE && type != ENTRY_DIR) || record + path_offset >= end) {
+            destroy_manifest(manifest);
+            return NULL;
+        }
+        struct timespec mtime = { .tv_sec = sec, .tv_nsec = nsec };
+        append(manifest, type, mode, size, mtime, record + path_offset);
+        offset += end - record + 1;
+    }
+    return manifest;
+}
+
+void destroy_manifest(Manifest manifest) {
+    if (!manifest) {
+        return;
+    }
+    for (int i = 0; i < manifest->count; i++) {
+        free(manifest->entries[i].path);
+    }
+    free(manifest->entries);
+    free(manifest);
+}
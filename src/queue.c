@@ -12,34 +12,47 @@ Queue create_queue(int size) {
         queue->data[i] = NULL;
     }
     queue->free_slots = queue->size = size;
+    queue->head = 0;
     return queue;
 }
 
 void insert_file_info(Queue queue, FileInfo file_info) {
-    for (int i = 0; i < queue->size; i++) {
-        if (queue->data[i] == NULL) {
-            queue->data[i] = file_info;
-            queue->free_slots--;
-            return;
-        }
+    if (queue->free_slots == 0) {
+        return;
     }
+    int used = queue->size - queue->free_slots;
+    queue->data[(queue->head + used) % queue->size] = file_info;
+    queue->free_slots--;
 }
 
-FileInfo get_first(Queue queue) {
-    for (int i = 0; i < queue->size; i++) {
-        if (queue->data[i] != NULL) {
-            FileInfo file_info = queue->data[i];
-            queue->data[i] = NULL;
-            queue->free_slots++;
-            return file_info;
-        }
+FileInfo remove_file_info(Queue queue, int k) {
+    if (k < 0 || k >= queue->size - queue->free_slots) {
+        return NULL;
+    }
+    FileInfo file_info = queue->data[(queue->head + k) % queue->size];
+
+    // Shift the file infos in front of it one slot towards the back
+    for (int i = k; i > 0; i--) {
+        queue->data[(queue->head + i) % queue->size] = queue->data[(queue->head + i - 1) % queue->size];
     }
-    return NULL;
+    queue->data[queue->head] = NULL;
+    queue->head = (queue->head + 1) % queue->size;
+    queue->free_slots++;
+    return file_info;
+}
+
+FileInfo peek_file_info(Queue queue, int k) {
+    if (k < 0 || k >= queue->size - queue->free_slots) {
+        return NULL;
+    }
+    return queue->data[(queue->head + k) % queue->size];
 }
 
 void destroy_queue(Queue queue) {
     for (int i = 0; i < queue->size; i++) {
-        destroy_file_info(queue->data[i]);
+        if (queue->data[i]) {
+            destroy_file_info(queue->data[i]);
+        }
     }
     free(queue->data);
     free(queue);
@@ -0,0 +1,57 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "relay.h"
+
+
+Relay create_relay(const char* dir, int total) {
+    Relay relay = malloc(sizeof(*relay));
+    pthread_mutex_init(&relay->mutex, NULL);
+    pthread_cond_init(&relay->landed, NULL);
+    relay->dir = strdup(dir);
+    relay->files = NULL;
+    relay->count = relay->capacity = 0;
+    relay->total = total;
+    relay->complete = (total == 0);
+    return relay;
+}
+
+void relay_landed(Relay relay, const char* path) {
+    pthread_mutex_lock(&relay->mutex);
+    if (!relay->complete) {
+        if (relay->count == relay->capacity) {
+            relay->capacity = relay->capacity ? relay->capacity * 2 : 64;
+            relay->files = realloc(relay->files, sizeof(char*) * relay->capacity);
+        }
+        relay->files[relay->count++] = strdup(path);
+        pthread_cond_broadcast(&relay->landed);
+    }
+    pthread_mutex_unlock(&relay->mutex);
+}
+
+void relay_complete(Relay relay) {
+    pthread_mutex_lock(&relay->mutex);
+    relay->complete = 1;
+    pthread_cond_broadcast(&relay->landed);
+    pthread_mutex_unlock(&relay->mutex);
+}
+
+int relay_attach(Relay relay, const char* dir, int can_stream) {
+    pthread_mutex_lock(&relay->mutex);
+    int streaming = !relay->complete && can_stream && !strcmp(dir, relay->dir);
+    while (!streaming && !relay->complete) {
+        pthread_cond_wait(&relay->landed, &relay->mutex);
+    }
+    pthread_mutex_unlock(&relay->mutex);
+    return streaming;
+}
+
+char* relay_next(Relay relay, int i) {
+    pthread_mutex_lock(&relay->mutex);
+    while (relay->count <= i) {
+        pthread_cond_wait(&relay->landed, &relay->mutex);
+    }
+    char* path = relay->files[i];
+    pthread_mutex_unlock(&relay->mutex);
+    return path;
+}
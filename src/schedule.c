@@ -0,0 +1,127 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include "schedule.h"
+
+
+Schedule create_schedule(const char* root) {
+    Schedule schedule = malloc(sizeof(*schedule));
+    schedule->root = strdup(root);
+    schedule->policy = POLICY_FIFO;
+    schedule->patterns = NULL;
+    schedule->no_patterns = 0;
+    schedule->entries = NULL;
+    schedule->count = schedule->capacity = 0;
+    return schedule;
+}
+
+int set_policy(Schedule schedule, const char* description) {
+    if (!strcmp(description, "fifo")) {
+        schedule->policy = POLICY_FIFO;
+    }
+    else if (!strcmp(description, "smallest")) {
+        schedule->policy = POLICY_SMALLEST;
+    }
+    else if (!strcmp(description, "largest")) {
+        schedule->policy = POLICY_LARGEST;
+    }
+    else if (!strncmp(description, "priority:", strlen("priority:"))) {
+        schedule->policy = POLICY_PRIORITY;
+        char* list = strdup(description + strlen("priority:"));
+        char* save;
+        for (char* pattern = strtok_r(list, ",", &save); pattern; pattern = strtok_r(NULL, ",", &save)) {
+            schedule->patterns = realloc(schedule->patterns, sizeof(char*) * (schedule->no_patterns + 1));
+            schedule->patterns[schedule->no_patterns++] = strdup(pattern);
+        }
+        free(list);
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+// Index of the first pattern that matches the path relative to the root or its base name
+static int rank_of(Schedule schedule, const char* path) {
+    const char* relative = path + strlen(schedule->root);
+    while (*relative == '/') {
+        relative++;
+    }
+    const char* base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    for (int i = 0; i < schedule->no_patterns; i++) {
+        if (!fnmatch(schedule->patterns[i], relative, 0) || !fnmatch(schedule->patterns[i], base, 0)) {
+            return i;
+        }
+    }
+    return schedule->no_patterns;
+}
+
+void schedule_add(Schedule schedule, const char* path, off_t size) {
+    if (schedule->count == schedule->capacity) {
+        schedule->capacity = schedule->capacity ? schedule->capacity * 2 : 64;
+        schedule->entries = realloc(schedule->entries, sizeof(struct schedule_entry) * schedule->capacity);
+    }
+    struct schedule_entry* entry = &schedule->entries[schedule->count];
+    entry->path = strdup(path);
+    entry->size = size;
+    entry->rank = (schedule->policy == POLICY_PRIORITY) ? rank_of(schedule, path) : 0;
+    entry->seq = schedule->count++;
+}
+
+static int by_smallest(const void* a, const void* b) {
+    const struct schedule_entry* x = a;
+    const struct schedule_entry* y = b;
+    if (x->size != y->size) {
+        return (x->size < y->size) ? -1 : 1;
+    }
+    return x->seq - y->seq;
+}
+
+static int by_largest(const void* a, const void* b) {
+    const struct schedule_entry* x = a;
+    const struct schedule_entry* y = b;
+    if (x->size != y->size) {
+        return (x->size > y->size) ? -1 : 1;
+    }
+    return x->seq - y->seq;
+}
+
+static int by_rank(const void* a, const void* b) {
+    const struct schedule_entry* x = a;
+    const struct schedule_entry* y = b;
+    if (x->rank != y->rank) {
+        return x->rank - y->rank;
+    }
+    return x->seq - y->seq;
+}
+
+void schedule_sort(Schedule schedule) {
+    switch (schedule->policy) {
+    case POLICY_SMALLEST:
+        qsort(schedule->entries, schedule->count, sizeof(struct schedule_entry), by_smallest);
+        break;
+    case POLICY_LARGEST:
+        qsort(schedule->entries, schedule->count, sizeof(struct schedule_entry), by_largest);
+        break;
+    case POLICY_PRIORITY:
+        qsort(schedule->entries, schedule->count, sizeof(struct schedule_entry), by_rank);
+        break;
+    default:
+        break;
+    }
+}
+
+void destroy_schedule(Schedule schedule) {
+    for (int i = 0; i < schedule->count; i++) {
+        free(schedule->entries[i].path);
+    }
+    for (int i = 0; i < schedule->no_patterns; i++) {
+        free(schedule->patterns[i]);
+    }
+    free(schedule->entries);
+    free(schedule->patterns);
+    free(schedule->root);
+    free(schedule);
+}
@@ -14,36 +14,68 @@
 #include "common.h"
 
 
-void* client_communication(void* args);
+// Print the usage and exit
+static void usage(void) {
+    fprintf(stderr, "Usage: -p <port_number> -s <thread_pool_size> [-S <max_pool_size>] [-a] -q <queue_size> -b <block_size> [-m] [-k <prefetch_depth>] [-M <prefetch_budget_mb>] [-u <unix_socket_path>] [-T <trace_dir>]\n");
+    exit(EXIT_FAILURE);
+}
+
+// Return the value of the i-th argument (a flag), advancing i - exits with the usage if it is missing
+static char* flag_value(int argc, char* argv[], int* i) {
+    if (*i + 1 >= argc) {
+        usage();
+    }
+    return argv[++*i];
+}
 
 
 int main(int argc, char* argv[]) {
-    if (argc != 9) {
-        fprintf(stderr, "Usage: -p <port_number> -s <thread_pool_size> -q <queue_size> -b <block_size>\n");
-        exit(EXIT_FAILURE);
+    if (argc < 9) {
+        usage();
     }
 
     int port_number, thread_pool_size, queue_size, block_size;
     port_number = thread_pool_size = queue_size = block_size = 0;
+    char* unix_path = NULL;
 
     // Parse arguments
     int i;
     for (i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "-p")) {
-            port_number = atoi(argv[++i]);
+            port_number = atoi(flag_value(argc, argv, &i));
         }
         else if (!strcmp(argv[i], "-s")) {
-            thread_pool_size = atoi(argv[++i]);
+            thread_pool_size = atoi(flag_value(argc, argv, &i));
         }
         else if (!strcmp(argv[i], "-q")) {
-            queue_size = atoi(argv[++i]);
+            queue_size = atoi(flag_value(argc, argv, &i));
         }
         else if (!strcmp(argv[i], "-b")) {
-            block_size = atoi(argv[++i]);
+            block_size = atoi(flag_value(argc, argv, &i));
+        }
+        else if (!strcmp(argv[i], "-m")) {
+            mmap_send = 1;
+        }
+        else if (!strcmp(argv[i], "-k")) {
+            prefetch_depth = atoi(flag_value(argc, argv, &i));
+        }
+        else if (!strcmp(argv[i], "-M")) {
+            prefetch_budget = (off_t) atoi(flag_value(argc, argv, &i)) * 1024 * 1024;
+        }
+        else if (!strcmp(argv[i], "-S")) {
+            pool_max = atoi(flag_value(argc, argv, &i));
+        }
+        else if (!strcmp(argv[i], "-a")) {
+            pool_affinity = 1;
+        }
+        else if (!strcmp(argv[i], "-u")) {
+            unix_path = flag_value(argc, argv, &i);
+        }
+        else if (!strcmp(argv[i], "-T")) {
+            trace_dir = flag_value(argc, argv, &i);
         }
         else {
-            fprintf(stderr, "Usage: -p <port_number> -s <thread_pool_size> -q <queue_size> -b <block_size>\n");
-            exit(EXIT_FAILURE);
+            usage();
         }
     }
 
@@ -52,193 +84,62 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "None of the arguments can be less or equal than zero\n");
         exit(EXIT_FAILURE);
     }
+    if (pool_max < 0) {
+        fprintf(stderr, "Max pool size cannot be less than zero\n");
+        exit(EXIT_FAILURE);
+    }
+    if (prefetch_depth < 0 || prefetch_budget < 0) {
+        fprintf(stderr, "Prefetch depth and budget cannot be less than zero\n");
+        exit(EXIT_FAILURE);
+    }
 
-    // Create a queue and initialize it's mutex and cond variables
-    queue = create_queue(queue_size);
-    pthread_mutex_init(&queue_mutex, NULL);
-    pthread_cond_init(&queue_non_empty, NULL);
-    pthread_cond_init(&queue_non_full, NULL);
+    // A client that disconnects (for example while watching) must not terminate the server
+    signal(SIGPIPE, SIG_IGN);
 
-    // Create workers thread pool
-    workers = malloc(sizeof(pthread_t) * thread_pool_size);
-    for (int i = 0; i < thread_pool_size; i++) {
-        pthread_create(&workers[i], NULL, process, NULL);
+    // Every session's trace is written inside the trace directory
+    if (trace_dir) {
+        recursive_mkdir(trace_dir);
     }
 
+    // Create the queue, the workers thread pool and the prefetch thread
+    start_server(thread_pool_size, queue_size);
+
     printf("\nServer's parameters are:\n");
     printf("Port number: %d\n", port_number);
-    printf("Thread pool size: %d\n", thread_pool_size);
+    printf("Thread pool size: %d - %d%s\n", thread_pool_size, pool_max, pool_affinity ? " (pinned to CPUs)" : "");
     printf("Queue size: %d\n", queue_size);
     printf("Block size: %d\n", block_size);
-    printf("Server was successfully initialized...\n");
-
-
-    // Create socket
-    int listen_socket;
-    if ((listen_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror_exit("main: socket");
+    printf("Send mode: %s\n", mmap_send ? "mmap" : "read");
+    printf("Prefetch depth: %d\n", prefetch_depth);
+    printf("Prefetch budget: %lld MB\n", (long long) prefetch_budget / (1024 * 1024));
+    if (unix_path) {
+        printf("Unix socket: %s\n", unix_path);
     }
-
-    // Initialize sockaddr_in struct
-    struct sockaddr_in server;
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = htonl(INADDR_ANY);
-    server.sin_port = htons(port_number);
-
-    int reuse = 1;
-    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, (const char*) &reuse, sizeof(reuse)) < 0) {
-        perror_exit("main: setsockopt");
+    if (trace_dir) {
+        printf("Trace directory: %s\n", trace_dir);
     }
+    printf("Server was successfully initialized...\n");
 
-    // Bind socket to address
-    if (bind(listen_socket, (struct sockaddr*) &server, sizeof(server)) < 0) {
-        perror_exit("main: bind");
-    }
-
-    // Listen for connections
-    if (listen(listen_socket, MAX_CONNECTIONS) < 0) {
-        perror_exit("main: listen");
-    }
-    printf("\nListening for connections to port %d...\n", port_number);
-
-    int client_socket;
-    struct sockaddr_in client;
-    socklen_t client_len;
-
-    while (1) {
-        // Accept a connection request
-        if ((client_socket = accept(listen_socket, (struct sockaddr*) &client, &client_len)) < 0) {
-            perror_exit("main: accept");
-        }
-
-        // Set proper args for communication's thread routine
-        arg_set args;
-        args.fd = client_socket;
-        args.block_size = block_size;
 
-        // Create a new communication thread
-        pthread_t thr;
-        if (pthread_create(&thr, NULL, client_communication, (void*) &args)) {
+    // Clients on the same host can also connect to a Unix domain socket, served by a thread of its own
+    pthread_t unix_thread;
+    arg_set unix_args;
+    if (unix_path) {
+        unix_args.fd = create_unix_listener(unix_path);
+        unix_args.block_size = block_size;
+        printf("\nListening for connections to %s...\n", unix_path);
+        if (pthread_create(&unix_thread, NULL, serve, &unix_args)) {
             fprintf(stderr, "main: pthread_create\n");
             exit(EXIT_FAILURE);
         }
     }
 
-}
-
-
-/// Note: if an error occurs inside the thread we close the socked and exit the thread. We do not exit the server process !!! ///
-
-void* client_communication(void* args) {
-    // Fetch information
-    arg_set* a = args;
-    int sock = a->fd;
-    int block_size = a->block_size;
-
-    // Detach communication thread - we do not need to join
-    int error;
-    if ((error = pthread_detach(pthread_self()))) {
-        close(sock);
-        perror_thr("client_communication: pthread_detach", pthread_self());
-    }
-
-    // Initialize
-    char buffer[BUFFER_SIZE];
-    memset(buffer, 0, BUFFER_SIZE);
-
-    // Read directory path
-    ssize_t bytes;
-    bytes = read(sock, buffer, BUFFER_SIZE);
-    if (bytes == -1) {
-        close(sock);
-        perror_thr("client_communication: read", pthread_self());
-    }
-
-    // Ensure the path corresponds indeed to a directory
-    error = is_dir(buffer);
-    if (error != 1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        strcat(buffer, "INVALID DIR");
-        bytes = write(sock, buffer, strlen("INVALID DIR") + 1);
-        if (bytes == -1) {
-            close(sock);
-            perror_thr("client_communication: write", pthread_self());
-        }
-        close(sock);
-        perror_thr("client_communication: invalid directory", pthread_self());
-    }
-
-    // Find the number of files that reside inside the given directory
-    int no_files = count_no_files(buffer);
-
-    // If we could not open the directory or some nested directory (for example no permissions)
-    if (no_files < 0) {
-        memset(buffer, 0, BUFFER_SIZE);
-        strcat(buffer, "COULD NOT OPEN DIR/S");
-        bytes = write(sock, buffer, strlen("COULD NOT OPEN DIR/S") + 1);
-        if (bytes == -1) {
-            close(sock);
-            perror_thr("client_communication: write", pthread_self());
-        }
-        close(sock);
-        perror_thr("count_no_files: opendir", pthread_self());
-    }
-
-    // Send the number of files that reside inside the given directory
-    char* msg = malloc(sizeof(char) * MAX_REPR);
-    sprintf(msg, "%d", no_files);
-    bytes = write(sock, msg, strlen(msg) + 1);
-    if (bytes == -1) {
-        free(msg);
-        close(sock);
-        perror_thr("client_communication: write", pthread_self());
-    }
-
-    // Wait for response
-    memset(msg, 0, MAX_REPR);
-    bytes = read(sock, msg, ACK_LEN);
-    if (bytes == -1) {
-        free(msg);
-        close(sock);
-        perror_thr("send_file: read", pthread_self());
-    }
-    if (strcmp(msg, "NF READ")) {
-        free(msg);
-        close(sock);
-        perror_thr("send_file: error during server-client communication", pthread_self());
-    }
-
-    // Write block size and wait response
-    memset(msg, 0, MAX_REPR);
-    sprintf(msg, "%d", block_size);
-    bytes = write(sock, msg, strlen(msg) + 1);
-    if (bytes == -1) {
-        free(msg);
-        close(sock);
-        perror_thr("send_file: write", pthread_self());
-    }
-    memset(msg, 0, MAX_REPR);
-    bytes = read(sock, msg, ACK_LEN);
-    if (bytes == -1) {
-        free(msg);
-        close(sock);
-        perror_thr("send_file: read", pthread_self());
-    }
-    if (strcmp(msg, "BS READ")) {
-        free(msg);
-        close(sock);
-        perror_thr("send_file: error during server-client communication", pthread_self());
-    }
-    free(msg);
-
-    // Create and initialize client's mutex
-    pthread_mutex_t* client_mutex = malloc(sizeof(*client_mutex));
-    pthread_mutex_init(client_mutex, NULL);
-
-    // Insert the directory's content into the queue
-    printf("[Communication Thread %ld]: about to scan directory %s\n", pthread_self(), buffer);
-    scan_dir(buffer, sock, block_size, client_mutex);
+    // Create the listening socket and serve the connections
+    int listen_socket = create_listener(port_number);
+    printf("\nListening for connections to port %d...\n", port_number);
 
-    printf("[Communication Thread %ld]: exiting...\n", pthread_self());
-    pthread_exit(NULL);
-}
\ No newline at end of file
+    arg_set args;
+    args.fd = listen_socket;
+    args.block_size = block_size;
+    serve(&args);
+}
@@ -0,0 +1,63 @@
+#include <stdlib.h>
+
+#include "session.h"
+
+
+Session create_session(void) {
+    Session session = malloc(sizeof(*session));
+    pthread_mutex_init(&session->refs_mutex, NULL);
+    pthread_cond_init(&session->synced, NULL);
+    session->refs = 1;
+    session->failed = 0;
+    session->busy = 0;
+    session->trace = NULL;
+    return session;
+}
+
+int retain_session(Session session) {
+    pthread_mutex_lock(&session->refs_mutex);
+    int failed = session->failed;
+    if (!failed) {
+        session->refs++;
+    }
+    pthread_mutex_unlock(&session->refs_mutex);
+    return failed ? -1 : 0;
+}
+
+int release_session(Session session) {
+    pthread_mutex_lock(&session->refs_mutex);
+    int last = (--session->refs == 0);
+    pthread_cond_broadcast(&session->synced);
+    pthread_mutex_unlock(&session->refs_mutex);
+    return last;
+}
+
+void fail_session(Session session) {
+    pthread_mutex_lock(&session->refs_mutex);
+    session->failed = 1;
+    pthread_mutex_unlock(&session->refs_mutex);
+}
+
+int session_failed(Session session) {
+    pthread_mutex_lock(&session->refs_mutex);
+    int failed = session->failed;
+    pthread_mutex_unlock(&session->refs_mutex);
+    return failed;
+}
+
+int sync_session(Session session) {
+    pthread_mutex_lock(&session->refs_mutex);
+    while (session->refs > 1) {
+        pthread_cond_wait(&session->synced, &session->refs_mutex);
+    }
+    int failed = session->failed;
+    pthread_mutex_unlock(&session->refs_mutex);
+    return failed;
+}
+
+void destroy_session(Session session) {
+    pthread_mutex_destroy(&session->refs_mutex);
+    pthread_cond_destroy(&session->synced);
+    destroy_trace(session->trace);
+    free(session);
+}
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+
+Trace create_trace(const char* path) {
+    Trace trace = malloc(sizeof(*trace));
+    trace->path = strdup(path);
+    trace->spans = malloc(sizeof(struct trace_span) * TRACE_SPANS);
+    atomic_init(&trace->count, 0);
+    return trace;
+}
+
+long long trace_time(const struct timespec* time) {
+    return time->tv_sec * 1000000LL + time->tv_nsec / 1000;
+}
+
+long long trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return trace_time(&now);
+}
+
+void trace_span(Trace trace, const char* name, const char* detail, long long start, long long end) {
+    if (!trace) {
+        return;
+    }
+    int i = atomic_fetch_add_explicit(&trace->count, 1, memory_order_relaxed);
+    if (i >= TRACE_SPANS) {
+        return;
+    }
+    struct trace_span* span = &trace->spans[i];
+    span->name = name;
+    span->tid = syscall(SYS_gettid);
+    span->start = start;
+    span->duration = end - start;
+
+    // Keep the end of the detail, which is the most specific part of a path
+    size_t len = detail ? strlen(detail) : 0;
+    const char* tail = (len >= TRACE_DETAIL) ? detail + len - (TRACE_DETAIL - 1) : detail;
+    snprintf(span->detail, TRACE_DETAIL, "%s", tail ? tail : "");
+}
+
+// Write the string escaped for JSON
+static void write_escaped(FILE* file, const char* s) {
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(file, "\\%c", *s);
+        }
+        else if ((unsigned char) *s < 0x20) {
+            fprintf(file, "\\u%04x", *s);
+        }
+        else {
+            fputc(*s, file);
+        }
+    }
+}
+
+int write_trace(Trace trace) {
+    FILE* file = fopen(trace->path, "w");
+    if (!file) {
+        return -1;
+    }
+    int count = atomic_load(&trace->count);
+    int recorded = (count < TRACE_SPANS) ? count : TRACE_SPANS;
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"spans\":%d,\"dropped\":%d},\"traceEvents\":[\n", recorded, count - recorded);
+    for (int i = 0; i < recorded; i++) {
+        struct trace_span* span = &trace->spans[i];
+        fprintf(file, "{\"name\":\"%s\",\"cat\":\"clone\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,\"args\":{\"detail\":\"",
+                span->name, getpid(), span->tid, span->start, span->duration);
+        write_escaped(file, span->detail);
+        fprintf(file, "\"}}%s\n", (i < recorded - 1) ? "," : "");
+    }
+    fprintf(file, "]}\n");
+    return fclose(file) ? -1 : 0;
+}
+
+void destroy_trace(Trace trace) {
+    if (!trace) {
+        return;
+    }
+    free(trace->spans);
+    free(trace->path);
+    free(trace);
+}
@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+
+#include "watch.h"
+
+#define WATCH_MASK (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+
+// A moved entry whose destination has not been seen yet
+struct pending_move {
+    uint32_t cookie;
+    char* path;
+    int is_dir;
+};
+
+
+/////////////////////////////////////////////// Changes ///////////////////////////////////////////////
+
+// Check whether path is dir or lies inside it
+static int is_under(const char* path, const char* dir) {
+    size_t len = strlen(dir);
+    return !strncmp(path, dir, len) && (path[len] == '\0' || path[len] == '/');
+}
+
+static void remove_change(Watcher watcher, int i) {
+    free(watcher->changes[i].path);
+    free(watcher->changes[i].new_path);
+    memmove(&watcher->changes[i], &watcher->changes[i + 1], sizeof(struct change) * (watcher->no_changes - i - 1));
+    watcher->no_changes--;
+}
+
+// Append a change, dropping the earlier changes of the same path since only the last state matters
+static void add_change(Watcher watcher, int type, const char* path, const char* new_path) {
+    const char* target = new_path ? new_path : path;
+    for (int i = 0; i < watcher->no_changes; i++) {
+        struct change* c = &watcher->changes[i];
+        if (c->type == CHANGE_RENAMED) {
+            // The destination of an earlier rename is replaced: the renamed source must still disappear
+            if (!strcmp(c->new_path, target)) {
+                c->type = CHANGE_DELETED;
+                free(c->new_path);
+                c->new_path = NULL;
+            }
+        }
+        else if (!strcmp(c->path, target)) {
+            remove_change(watcher, i--);
+        }
+    }
+    // Pending changes inside a renamed entry must follow it, under its new name
+    struct change* moved = NULL;
+    int no_moved = 0;
+    if (type == CHANGE_RENAMED) {
+        moved = malloc(sizeof(struct change) * (watcher->no_changes + 1));
+        for (int i = 0; i < watcher->no_changes; i++) {
+            struct change* c = &watcher->changes[i];
+            if (c->type != CHANGE_RENAMED && is_under(c->path, path)) {
+                char renamed[PATH_MAX];
+                snprintf(renamed, sizeof(renamed), "%s%s", new_path, c->path + strlen(path));
+                moved[no_moved].type = c->type;
+                moved[no_moved++].path = strdup(renamed);
+                remove_change(watcher, i--);
+            }
+        }
+    }
+    if (watcher->no_changes == watcher->change_capacity) {
+        watcher->change_capacity = watcher->change_capacity ? watcher->change_capacity * 2 : 64;
+        watcher->changes = realloc(watcher->changes, sizeof(struct change) * watcher->change_capacity);
+    }
+    struct change* c = &watcher->changes[watcher->no_changes++];
+    c->type = type;
+    c->path = strdup(path);
+    c->new_path = new_path ? strdup(new_path) : NULL;
+    for (int i = 0; i < no_moved; i++) {
+        add_change(watcher, moved[i].type, moved[i].path, NULL);
+        free(moved[i].path);
+    }
+    free(moved);
+}
+
+void clear_changes(Watcher watcher) {
+    for (int i = 0; i < watcher->no_changes; i++) {
+        free(watcher->changes[i].path);
+        free(watcher->changes[i].new_path);
+    }
+    watcher->no_changes = 0;
+}
+
+
+/////////////////////////////////////////////// Watches ///////////////////////////////////////////////
+
+static int find_watch(Watcher watcher, int wd) {
+    for (int i = 0; i < watcher->no_watches; i++) {
+        if (watcher->wds[i] == wd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void remove_watch(Watcher watcher, int i) {
+    free(watcher->dirs[i]);
+    watcher->wds[i] = watcher->wds[watcher->no_watches - 1];
+    watcher->dirs[i] = watcher->dirs[watcher->no_watches - 1];
+    watcher->no_watches--;
+}
+
+// Watch dirpath and every directory inside it; if report_files is set, every file found is reported as modified
+// (used for directories that appear while watching, whose files may have been created before the watch was added)
+static int add_watch_tree(Watcher watcher, const char* dirpath, int report_files) {
+    int wd = inotify_add_watch(watcher->fd, dirpath, WATCH_MASK);
+    if (wd < 0) {
+        return -1;
+    }
+    int i = find_watch(watcher, wd);
+    if (i >= 0) {
+        free(watcher->dirs[i]);
+        watcher->dirs[i] = strdup(dirpath);
+    }
+    else {
+        if (watcher->no_watches == watcher->watch_capacity) {
+            watcher->watch_capacity = watcher->watch_capacity ? watcher->watch_capacity * 2 : 64;
+            watcher->wds = realloc(watcher->wds, sizeof(int) * watcher->watch_capacity);
+            watcher->dirs = realloc(watcher->dirs, sizeof(char*) * watcher->watch_capacity);
+        }
+        watcher->wds[watcher->no_watches] = wd;
+        watcher->dirs[watcher->no_watches++] = strdup(dirpath);
+    }
+
+    DIR* dir = opendir(dirpath);
+    if (!dir) {
+        return -1;
+    }
+    char path[PATH_MAX];
+    struct dirent* dp;
+    while ((dp = readdir(dir))) {
+        if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..")) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dirpath, dp->d_name);
+        if (dp->d_type == DT_DIR) {
+            add_watch_tree(watcher, path, report_files);
+        }
+        else if (dp->d_type == DT_REG && report_files) {
+            add_change(watcher, CHANGE_MODIFIED, path, NULL);
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+// Stop watching dir and every directory inside it
+static void remove_watch_tree(Watcher watcher, const char* dir) {
+    for (int i = 0; i < watcher->no_watches; i++) {
+        if (is_under(watcher->dirs[i], dir)) {
+            inotify_rm_watch(watcher->fd, watcher->wds[i]);
+            remove_watch(watcher, i--);
+        }
+    }
+}
+
+// A watched directory was renamed: update the paths of its watches
+static void rename_watch_tree(Watcher watcher, const char* old_dir, const char* new_dir) {
+    char path[PATH_MAX];
+    size_t len = strlen(old_dir);
+    for (int i = 0; i < watcher->no_watches; i++) {
+        if (is_under(watcher->dirs[i], old_dir)) {
+            snprintf(path, sizeof(path), "%s%s", new_dir, watcher->dirs[i] + len);
+            free(watcher->dirs[i]);
+            watcher->dirs[i] = strdup(path);
+        }
+    }
+}
+
+Watcher create_watcher(const char* root) {
+    Watcher watcher = calloc(1, sizeof(*watcher));
+    watcher->root = strdup(root);
+    if ((watcher->fd = inotify_init1(IN_CLOEXEC)) < 0 || add_watch_tree(watcher, root, 0) < 0) {
+        destroy_watcher(watcher);
+        return NULL;
+    }
+    return watcher;
+}
+
+void destroy_watcher(Watcher watcher) {
+    clear_changes(watcher);
+    if (watcher->fd >= 0) {
+        close(watcher->fd);
+    }
+    for (int i = 0; i < watcher->no_watches; i++) {
+        free(watcher->dirs[i]);
+    }
+    free(watcher->wds);
+    free(watcher->dirs);
+    free(watcher->changes);
+    free(watcher->root);
+    free(watcher);
+}
+
+
+/////////////////////////////////////////////// Events ///////////////////////////////////////////////
+
+static long elapsed_ms(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// Translate one inotify event into changes
+static void handle_event(Watcher watcher, struct inotify_event* event, struct pending_move** moves, int* no_moves) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        // Events were lost: report every file of the tree as modified
+        add_watch_tree(watcher, watcher->root, 1);
+        return;
+    }
+    int i = find_watch(watcher, event->wd);
+    if (i < 0) {
+        return;
+    }
+    if (event->mask & IN_IGNORED) {
+        remove_watch(watcher, i);
+        return;
+    }
+    if (event->len == 0) {
+        return;     // event about the watched directory itself, its parent reports it
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", watcher->dirs[i], event->name);
+    int is_dir = (event->mask & IN_ISDIR) != 0;
+
+    if (event->mask & IN_MOVED_FROM) {
+        *moves = realloc(*moves, sizeof(struct pending_move) * (*no_moves + 1));
+        (*moves)[*no_moves].cookie = event->cookie;
+        (*moves)[*no_moves].path = strdup(path);
+        (*moves)[(*no_moves)++].is_dir = is_dir;
+    }
+    else if (event->mask & IN_MOVED_TO) {
+        for (int j = 0; j < *no_moves; j++) {
+            if ((*moves)[j].cookie == event->cookie) {
+                add_change(watcher, CHANGE_RENAMED, (*moves)[j].path, path);
+                if (is_dir) {
+                    rename_watch_tree(watcher, (*moves)[j].path, path);
+                }
+                free((*moves)[j].path);
+                (*moves)[j] = (*moves)[--(*no_moves)];
+                return;
+            }
+        }
+        // Moved in from outside the tree: same as a creation
+        if (is_dir) {
+            add_watch_tree(watcher, path, 1);
+        }
+        else {
+            add_change(watcher, CHANGE_MODIFIED, path, NULL);
+        }
+    }
+    else if (event->mask & IN_DELETE) {
+        add_change(watcher, CHANGE_DELETED, path, NULL);
+    }
+    else if (is_dir) {
+        if (event->mask & IN_CREATE) {
+            add_watch_tree(watcher, path, 1);
+        }
+    }
+    else if (event->mask & (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE)) {
+        add_change(watcher, CHANGE_MODIFIED, path, NULL);
+    }
+}
+
+int collect_changes(Watcher watcher, int debounce_ms, int max_delay_ms) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pending_move* moves = NULL;
+    int no_moves = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Block for the first event, then keep reading until the tree has been quiet for debounce_ms
+    int timeout = -1;
+    while (1) {
+        struct pollfd pfd = { .fd = watcher->fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0) {
+            free(moves);
+            return -1;
+        }
+        else if (ready == 0) {
+            break;
+        }
+        ssize_t bytes = read(watcher->fd, buffer, sizeof(buffer));
+        if (bytes <= 0) {
+            free(moves);
+            return -1;
+        }
+        for (char* p = buffer; p < buffer + bytes; ) {
+            struct inotify_event* event = (struct inotify_event*) p;
+            handle_event(watcher, event, &moves, &no_moves);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+        if (timeout == -1) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+        long left = max_delay_ms - elapsed_ms(&start);
+        if (left <= 0) {
+            break;
+        }
+        timeout = (left < debounce_ms) ? left : debounce_ms;
+    }
+
+    // Entries moved out of the tree are gone
+    for (int j = 0; j < no_moves; j++) {
+        add_change(watcher, CHANGE_DELETED, moves[j].path, NULL);
+        if (moves[j].is_dir) {
+            remove_watch_tree(watcher, moves[j].path);
+        }
+        free(moves[j].path);
+    }
+    free(moves);
+    return watcher->no_changes;
+}
@@ -0,0 +1,667 @@
+#!/usr/bin/env python3
+"""Stress and scaling harness for dataServer.
+
+Runs hundreds of concurrent remoteClient processes against one dataServer on loopback:
+clients clone randomized trees with random options, some of them read through a throttling
+proxy (slow readers), some are killed mid-transfer and some drop the connection during the
+handshake (injected disconnects). Every clone that completes must be byte-exact, the server
+must survive and release every socket and inotify instance, a tree with read-only files must
+clone again over its own manifest clone, and under ThreadSanitizer the server must not report
+a race. Then the aggregate throughput is measured for growing numbers of concurrent
+clients and pool sizes.
+
+With --mode it runs one of the benchmarks instead:
+  compression  plain transfers against -z through the throttling proxy at several link speeds, for a source-like,
+               a mixed and a binary tree: time, bytes on the wire and the CPU time of the server and of the client
+  bursts       bursts of clients arriving together, separated by idle gaps, against a fixed pool of the minimum
+               size, a fixed pool of the maximum size and the elastic pool: client latencies per burst and the
+               elastic pool's size over time
+  largefile    one large file sent with the read loop and with mmap, from a cold and a warm page cache:
+               throughput, server CPU time and how much of the source and the clone stay in the page cache
+
+Usage: python3 tests/stress.py [--clients N] [--seed S] [--tsan] [--scaling 1,4,16,64]
+                               [--pools 1,2,4] [--no-scaling] [--keep]
+       python3 tests/stress.py --mode compression [--rates 1,4,16,0] [--compression-kb KB]
+       python3 tests/stress.py --mode bursts [--bursts N] [--burst-clients N] [--burst-gap S] [--burst-pool N]
+       python3 tests/stress.py --mode largefile [--large-mb MB]
+"""
+
+import argparse
+import ctypes
+import os
+import random
+import re
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+POLICIES = ["fifo", "smallest", "largest"]
+WORDS = ["int", "char", "return", "if", "else", "for", "while", "struct", "static", "void", "const", "size_t", "buffer",
+         "file_info", "session", "queue", "(", ")", "{", "}", ";", "=", "==", "->", "0", "1", "-1", "NULL", "i++", "//",
+         "the", "of", "a", "to", "is", "error", "len", "offset", "block_size", "fd", "path", "count", "next", "free"]
+
+
+def make_tree(root, rng, no_files, max_size, text=0.5):
+    """Create a random tree of no_files files (a text fraction of them, the rest binary, some empty) under root."""
+    dirs = [root]
+    os.makedirs(root)
+    for i in range(no_files):
+        if rng.random() < 0.2:
+            parent = rng.choice(dirs)
+            name = rng.choice(["src", "lib", "a b", "deep", "x" * rng.randint(1, 40), "d%d" % i])
+            path = os.path.join(parent, name)
+            if path not in dirs:
+                os.makedirs(path, exist_ok=True)
+                dirs.append(path)
+        size = 0 if rng.random() < 0.05 else int(max_size ** rng.random())
+        path = os.path.join(rng.choice(dirs), "f%d%s" % (i, rng.choice([".c", ".txt", ".bin", ".gz", ""])))
+        with open(path, "wb") as f:
+            if rng.random() < text:
+                # Lines of random words, which compress about as well as source code
+                lines, length = [], 0
+                while length < size:
+                    lines.append(" ".join(rng.choices(WORDS, k=rng.randint(1, 12))) + "\n")
+                    length += len(lines[-1])
+                f.write("".join(lines).encode()[:size])
+            else:
+                f.write(rng.randbytes(size))
+
+
+def tree_bytes(root):
+    return sum(os.path.getsize(os.path.join(d, f)) for d, _, files in os.walk(root) for f in files)
+
+
+def compare_trees(src, clone):
+    """Return None if clone holds exactly the files of src with the same bytes, otherwise the first difference."""
+    if not os.path.isdir(clone):
+        return "clone missing"
+    for d, _, files in os.walk(src):
+        for f in files:
+            path = os.path.join(d, f)
+            copy = os.path.join(clone, os.path.relpath(path, src))
+            if not os.path.isfile(copy):
+                return "missing " + copy
+            with open(path, "rb") as a, open(copy, "rb") as b:
+                if a.read() != b.read():
+                    return "content differs: " + copy
+    for d, _, files in os.walk(clone):
+        for f in files:
+            if not os.path.isfile(os.path.join(src, os.path.relpath(os.path.join(d, f), clone))):
+                return "extra file " + os.path.join(d, f)
+    return None
+
+
+def cached_fraction(path):
+    """Fraction of the file's pages that are in the page cache (mincore over a mapping of the file)."""
+    size = os.path.getsize(path)
+    if size == 0:
+        return 0.0
+    libc = ctypes.CDLL(None, use_errno=True)
+    libc.mmap.restype = ctypes.c_void_p
+    libc.mmap.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_long]
+    libc.munmap.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+    libc.mincore.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_void_p]
+    pages = (size + os.sysconf("SC_PAGE_SIZE") - 1) // os.sysconf("SC_PAGE_SIZE")
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        address = libc.mmap(None, size, 1, 1, fd, 0)     # PROT_READ, MAP_SHARED
+        if address in (None, ctypes.c_void_p(-1).value):
+            return 0.0
+        vector = (ctypes.c_ubyte * pages)()
+        libc.mincore(ctypes.c_void_p(address), size, vector)
+        libc.munmap(ctypes.c_void_p(address), size)
+    finally:
+        os.close(fd)
+    return sum(v & 1 for v in vector) / pages
+
+
+def set_cached(path, cached):
+    """Read the whole file into the page cache, or drop its (clean) pages from it."""
+    fd = os.open(path, os.O_RDONLY)
+    if cached:
+        while os.read(fd, 1 << 20):
+            pass
+    else:
+        os.fsync(fd)
+        os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+    os.close(fd)
+
+
+def run_client(command, timeout):
+    """Run a client, return its exit status, wall time and CPU time (user + system)."""
+    start = time.monotonic()
+    process = subprocess.Popen(command, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    deadline = start + timeout
+    while True:
+        pid, status, usage = os.wait4(process.pid, os.WNOHANG)
+        if pid:
+            break
+        if time.monotonic() > deadline:
+            process.kill()
+            _, status, usage = os.wait4(process.pid, 0)
+            break
+        time.sleep(0.005)
+    process.returncode = os.waitstatus_to_exitcode(status)
+    return process.returncode, time.monotonic() - start, usage.ru_utime + usage.ru_stime
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+class Server:
+    def __init__(self, binary, args, log_path, tsan, line_buffered=False):
+        self.port = free_port()
+        self.log_path = log_path
+        command = [binary, "-p", str(self.port)] + args
+        # The log is only read while the server runs if every line reaches it
+        if line_buffered and shutil.which("stdbuf"):
+            command = ["stdbuf", "-oL"] + command
+        # ThreadSanitizer cannot map its shadow memory on kernels with a high mmap randomization
+        if tsan and shutil.which("setarch"):
+            command = ["setarch", os.uname().machine, "-R"] + command
+        self.log = open(log_path, "w")
+        self.started = time.monotonic()
+        self.process = subprocess.Popen(command, stdout=self.log, stderr=subprocess.STDOUT)
+        for _ in range(100):
+            try:
+                socket.create_connection(("127.0.0.1", self.port)).close()
+                break
+            except OSError:
+                time.sleep(0.05)
+        time.sleep(0.2)
+
+    def alive(self):
+        return self.process.poll() is None
+
+    def cpu_seconds(self):
+        """CPU time (user + system) the server has used so far."""
+        with open("/proc/%d/stat" % self.process.pid) as f:
+            fields = f.read().rsplit(")", 1)[1].split()
+        return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+    def open_fds(self):
+        """Sockets and inotify instances held by the server."""
+        fds = 0
+        for fd in os.listdir("/proc/%d/fd" % self.process.pid):
+            try:
+                target = os.readlink("/proc/%d/fd/%s" % (self.process.pid, fd))
+            except OSError:
+                continue
+            if target.startswith("socket:") or "inotify" in target:
+                fds += 1
+        return fds
+
+    def stop(self):
+        if self.alive():
+            self.process.send_signal(signal.SIGINT)
+            try:
+                self.process.wait(5)
+            except subprocess.TimeoutExpired:
+                self.process.kill()
+                self.process.wait()
+        self.log.close()
+        with open(self.log_path, errors="replace") as f:
+            return f.read()
+
+
+class SlowProxy:
+    """Forward loopback connections to the server, letting the replies through at rate bytes per second (0: unlimited)
+    and counting them."""
+
+    def __init__(self, server_port, rate):
+        self.server_port = server_port
+        self.rate = rate
+        self.replied = 0
+        self.lock = threading.Lock()
+        self.listener = socket.socket()
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind(("127.0.0.1", 0))
+        self.listener.listen(512)
+        self.port = self.listener.getsockname()[1]
+        threading.Thread(target=self.accept, daemon=True).start()
+
+    def accept(self):
+        while True:
+            try:
+                client, _ = self.listener.accept()
+                server = socket.create_connection(("127.0.0.1", self.server_port))
+            except OSError:
+                return
+            for s in (client, server):
+                s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            threading.Thread(target=self.pipe, args=(client, server, False), daemon=True).start()
+            threading.Thread(target=self.pipe, args=(server, client, True), daemon=True).start()
+
+    def pipe(self, src, dst, reply):
+        rate = self.rate if reply else 0
+        start, sent = time.monotonic(), 0
+        try:
+            while True:
+                data = src.recv(16384)
+                if not data:
+                    break
+                dst.sendall(data)
+                sent += len(data)
+                if reply:
+                    with self.lock:
+                        self.replied += len(data)
+                if rate:
+                    ahead = sent / rate - (time.monotonic() - start)
+                    if ahead > 0:
+                        time.sleep(ahead)
+        except OSError:
+            pass
+        for s in (src, dst):
+            try:
+                s.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+        src.close()
+
+
+def drop_handshake(port, tree, stage):
+    """Connect and hang up at the given stage of the handshake."""
+    try:
+        s = socket.create_connection(("127.0.0.1", port))
+        if stage >= 1:
+            s.sendall(tree.encode() + b"\0")
+            s.recv(8)
+        if stage >= 2:
+            s.sendall(b"watch\nchecksum\0" if stage == 3 else b"checksum\0")
+            s.recv(64)
+        s.close()
+    except OSError:
+        pass
+
+
+def unprivileged():
+    """Prefix that runs a command as nobody when the harness runs as root (root writes over read-only files)."""
+    if os.getuid() == 0 and shutil.which("setpriv"):
+        return ["setpriv", "--reuid", "65534", "--regid", "65534", "--clear-groups"]
+    return []
+
+
+def reclone(client_bin, port, tree, out, timeout):
+    """Clone the tree twice into the same directory with a manifest, then once more without one.
+
+    A manifest applies the source modes, so the read-only files of the first clone must be replaced by the later ones.
+    """
+    for d, _, files in os.walk(tree):
+        for f in files[::3]:
+            os.chmod(os.path.join(d, f), 0o444)
+    os.makedirs(out)
+    os.chmod(out, 0o777)
+    failures = []
+    for run, options in enumerate((["-M"], ["-M", "-c"], [])):
+        rc = subprocess.call(unprivileged() + client_command(client_bin, ("127.0.0.1", port), tree, out, options),
+                             stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, timeout=timeout)
+        difference = compare_trees(tree, os.path.join(out, tree.lstrip("/")))
+        if rc != 0 or difference:
+            failures.append("re-clone %d (%s): exit status %d, %s" % (run + 1, " ".join(options), rc, difference))
+    return failures
+
+
+def client_command(binary, target, tree, out, options):
+    return [binary, "-i", target[0]] + (["-p", str(target[1])] if target[1] else []) + ["-d", tree, "-o", out] + options
+
+
+def random_options(rng):
+    options = []
+    for flag, p in (("-c", 0.5), ("-z", 0.3), ("-M", 0.2)):
+        if rng.random() < p:
+            options.append(flag)
+    if rng.random() < 0.5:
+        options += ["-P", rng.choice(POLICIES)]
+    return options
+
+
+def stress(args, work, trees, rng):
+    binary = "-tsan" if args.tsan else ""
+    server_bin = os.path.join(REPO, "bin", "dataServer" + binary)
+    client_bin = os.path.join(REPO, "bin", "remoteClient" + binary)
+    unix_path = os.path.join(work, "server.sock")
+    server_args = ["-s", "2", "-S", "8", "-q", "16", "-b", str(rng.choice([512, 4096, 65536])), "-u", unix_path]
+    if rng.random() < 0.5:
+        server_args.append("-m")
+    print("stress: %d clients, server %s" % (args.clients, " ".join(server_args)))
+    server = Server(server_bin, server_args, os.path.join(work, "server.log"), args.tsan)
+    baseline = server.open_fds()
+    proxies = [SlowProxy(server.port, rate) for rate in (512 * 1024, 1024 * 1024, 4 * 1024 * 1024)]
+
+    # Launch every client at once: complete ones (some over the unix socket, some behind a slow proxy),
+    # ones that are killed mid-transfer and ones that hang up during the handshake
+    clients, droppers, kinds = [], [], {}
+    start = time.monotonic()
+    for i in range(args.clients):
+        tree = rng.choice(trees)
+        out = os.path.join(work, "clients", str(i))
+        kind = rng.choices(["tcp", "unix", "slow", "kill", "handshake"], [60, 10, 10, 12, 8])[0]
+        kinds[kind] = kinds.get(kind, 0) + 1
+        if kind == "handshake":
+            thread = threading.Thread(target=drop_handshake, args=(server.port, tree, rng.randint(0, 3)))
+            thread.start()
+            droppers.append(thread)
+            continue
+        target = ("127.0.0.1", server.port)
+        options = random_options(rng)
+        if kind == "unix":
+            target = ("unix:" + unix_path, None)
+        elif kind == "slow":
+            target = ("127.0.0.1", rng.choice(proxies).port)
+        elif kind == "kill" and rng.random() < 0.3:
+            options.append("-w")
+        process = subprocess.Popen(client_command(client_bin, target, tree, out, options),
+                                   stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        deadline = start + rng.uniform(0.05, 2.0) if kind == "kill" else None
+        clients.append((process, kind, tree, out, deadline))
+    print("  " + ", ".join("%s %d" % item for item in sorted(kinds.items())))
+
+    # Kill the doomed clients at their deadline while waiting for the others
+    def kill_doomed():
+        for process, _, _, _, deadline in sorted((c for c in clients if c[4]), key=lambda c: c[4]):
+            time.sleep(max(0, deadline - time.monotonic()))
+            process.kill()
+            process.wait()
+    killer = threading.Thread(target=kill_doomed)
+    killer.start()
+    failures = []
+    for process, kind, tree, out, deadline in clients:
+        if deadline:
+            continue
+        try:
+            rc = process.wait(args.timeout)
+        except subprocess.TimeoutExpired:
+            process.kill()
+            failures.append("%s client %s: timed out" % (kind, out))
+            continue
+        if rc != 0:
+            failures.append("%s client %s: exit status %d" % (kind, out, rc))
+            continue
+        difference = compare_trees(tree, os.path.join(out, tree.lstrip("/")))
+        if difference:
+            failures.append("%s client %s: %s" % (kind, out, difference))
+    killer.join()
+    for thread in droppers:
+        thread.join()
+    elapsed = time.monotonic() - start
+    print("  all clients done in %.1f s" % elapsed)
+
+    # The server must survive, drop every session it had and still serve a new client
+    if not server.alive():
+        failures.append("server died with status %s" % server.process.returncode)
+    else:
+        fds = server.open_fds()
+        for _ in range(100):
+            if fds <= baseline:
+                break
+            time.sleep(0.1)
+            fds = server.open_fds()
+        if fds > baseline:
+            failures.append("server holds %d sockets/inotify instances, %d after it started" % (fds, baseline))
+        out = os.path.join(work, "clients", "last")
+        rc = subprocess.call(client_command(client_bin, ("127.0.0.1", server.port), trees[0], out, ["-c"]),
+                             stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, timeout=args.timeout)
+        difference = compare_trees(trees[0], os.path.join(out, trees[0].lstrip("/")))
+        if rc != 0 or difference:
+            failures.append("client after the stress run: exit status %d, %s" % (rc, difference))
+        failures += reclone(client_bin, server.port, trees[1], os.path.join(work, "clients", "reclone"), args.timeout)
+    for proxy in proxies:
+        proxy.listener.close()
+    log = server.stop()
+    races = log.count("WARNING: ThreadSanitizer")
+    if races:
+        failures.append("ThreadSanitizer reported %d warnings (see %s)" % (races, server.log_path))
+    return failures
+
+
+def scaling(args, work, rng):
+    """Aggregate throughput of n concurrent clients cloning the same tree, for every pool size."""
+    binary = "-tsan" if args.tsan else ""
+    server_bin = os.path.join(REPO, "bin", "dataServer" + binary)
+    client_bin = os.path.join(REPO, "bin", "remoteClient" + binary)
+    tree = os.path.join(work, "scaling")
+    make_tree(tree, rng, 200, 4 * 1024 * 1024)
+    size = tree_bytes(tree)
+    counts = [int(n) for n in args.scaling.split(",")]
+    failures = []
+    print("\nscaling: tree of %.1f MB, %d CPUs" % (size / 1e6, len(os.sched_getaffinity(0))))
+    print("%6s %8s %10s %12s %14s" % ("pool", "clients", "seconds", "total MB/s", "per client MB/s"))
+    for pool in [int(p) for p in args.pools.split(",")]:
+        server = Server(server_bin, ["-s", str(pool), "-q", "64", "-b", "65536"],
+                        os.path.join(work, "scaling-%d.log" % pool), args.tsan)
+        for n in counts:
+            outs = [os.path.join(work, "scaling-out", "%d-%d-%d" % (pool, n, i)) for i in range(n)]
+            start = time.monotonic()
+            processes = [subprocess.Popen(client_command(client_bin, ("127.0.0.1", server.port), tree, out, []),
+                                          stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL) for out in outs]
+            codes = [p.wait() for p in processes]
+            seconds = time.monotonic() - start
+            print("%6d %8d %10.2f %12.1f %14.1f" % (pool, n, seconds, n * size / seconds / 1e6, size / seconds / 1e6))
+            for out, rc in zip(outs, codes):
+                difference = compare_trees(tree, os.path.join(out, tree.lstrip("/")))
+                if rc != 0 or difference:
+                    failures.append("scaling client %s: exit status %d, %s" % (out, rc, difference))
+            shutil.rmtree(os.path.join(work, "scaling-out"), ignore_errors=True)
+        log = server.stop()
+        if log.count("WARNING: ThreadSanitizer"):
+            failures.append("ThreadSanitizer warnings while scaling (see %s)" % server.log_path)
+    return failures
+
+
+def compression(args, work, rng):
+    """Plain transfers against -z through the proxy at several link speeds: time, bytes on the wire and CPU time."""
+    binary = "-tsan" if args.tsan else ""
+    server_bin = os.path.join(REPO, "bin", "dataServer" + binary)
+    client_bin = os.path.join(REPO, "bin", "remoteClient" + binary)
+    trees = []
+    for name, text in (("source", 1.0), ("mixed", 0.5), ("binary", 0.0)):
+        tree = os.path.join(work, "compression", name)
+        make_tree(tree, rng, 80, args.compression_kb * 1024, text)
+        trees.append((name, tree))
+    server = Server(server_bin, ["-s", "2", "-q", "16", "-b", "65536"], os.path.join(work, "compression.log"), args.tsan)
+    failures = []
+    print("compression: link speeds %s MB/s (0: unlimited), %d CPUs" % (args.rates, len(os.sched_getaffinity(0))))
+    # The cost of -z is the CPU time it adds (server and client) per MB it keeps off the wire
+    print("%7s %6s %6s %9s %9s %9s %7s %11s %11s %15s" % ("tree", "MB/s", "mode", "raw MB", "seconds", "wire MB", "ratio",
+                                                           "server CPU", "client CPU", "CPU ms/MB saved"))
+    for name, tree in trees:
+        size = tree_bytes(tree)
+        for rate in [float(r) for r in args.rates.split(",")]:
+            plain = None
+            for options in ([], ["-z"]):
+                proxy = SlowProxy(server.port, rate * 1024 * 1024)
+                out = os.path.join(work, "compression-out")
+                cpu = server.cpu_seconds()
+                rc, seconds, client_cpu = run_client(client_command(client_bin, ("127.0.0.1", proxy.port), tree, out,
+                                                                    options), args.timeout)
+                cpu = server.cpu_seconds() - cpu
+                proxy.listener.close()
+                cost = "-"
+                if plain is None:
+                    plain = (proxy.replied, cpu + client_cpu)
+                elif plain[0] > proxy.replied:
+                    cost = "%.0f" % ((cpu + client_cpu - plain[1]) * 1e3 / ((plain[0] - proxy.replied) / 1e6))
+                print("%7s %6g %6s %9.1f %9.2f %9.1f %7.2f %10.2fs %10.2fs %15s" % (name, rate, "-z" if options else "plain",
+                      size / 1e6, seconds, proxy.replied / 1e6, proxy.replied / max(size, 1), cpu, client_cpu, cost))
+                difference = compare_trees(tree, os.path.join(out, tree.lstrip("/")))
+                if rc != 0 or difference:
+                    failures.append("compression client (%s, %g MB/s, %s): exit status %d, %s"
+                                    % (name, rate, " ".join(options), rc, difference))
+                shutil.rmtree(out, ignore_errors=True)
+    log = server.stop()
+    if log.count("WARNING: ThreadSanitizer"):
+        failures.append("ThreadSanitizer warnings while compressing (see %s)" % server.log_path)
+    return failures
+
+
+def pool_sizes(log):
+    """The pool resizes printed by the server: (seconds since it started, workers, reason)."""
+    return [(float(t), int(n), reason) for t, n, reason in re.findall(r"\[Pool ([\d.]+)s\]: (\d+) workers \((.*)\)", log)]
+
+
+def bursts(args, work, rng):
+    """Bursts of clients that arrive together, separated by idle gaps longer than the pool's idle timeout,
+    against a fixed pool of the minimum size, a fixed pool of the maximum size and the elastic pool between them."""
+    binary = "-tsan" if args.tsan else ""
+    server_bin = os.path.join(REPO, "bin", "dataServer" + binary)
+    client_bin = os.path.join(REPO, "bin", "remoteClient" + binary)
+    tree = os.path.join(work, "burst")
+    make_tree(tree, rng, 60, 512 * 1024)
+    pool = args.burst_pool
+    configs = (("fixed 1", ["-s", "1"]), ("fixed %d" % pool, ["-s", str(pool)]),
+               ("elastic 1-%d" % pool, ["-s", "1", "-S", str(pool)]))
+    failures = []
+    print("bursts: %d bursts of %d clients, %.0f s apart, tree of %.1f MB" % (args.bursts, args.burst_clients,
+          args.burst_gap, tree_bytes(tree) / 1e6))
+    print("%12s %6s %9s %9s %9s %9s %11s" % ("pool", "burst", "seconds", "p50 s", "p90 s", "max s", "peak pool"))
+    for name, server_options in configs:
+        log_path = os.path.join(work, "bursts-%s.log" % name.replace(" ", "-"))
+        server = Server(server_bin, server_options + ["-q", "32", "-b", "65536"], log_path, args.tsan, line_buffered=True)
+        windows = []
+        for burst in range(args.bursts):
+            if burst:
+                time.sleep(args.burst_gap)
+            outs = [os.path.join(work, "burst-out", str(i)) for i in range(args.burst_clients)]
+            results = [None] * len(outs)
+            start = time.monotonic()
+
+            def run(i):
+                results[i] = run_client(client_command(client_bin, ("127.0.0.1", server.port), tree, outs[i], []),
+                                        args.timeout)
+            threads = [threading.Thread(target=run, args=(i,)) for i in range(len(outs))]
+            for thread in threads:
+                thread.start()
+            for thread in threads:
+                thread.join()
+            end = time.monotonic()
+            window = (start - server.started, end - server.started)
+            windows.append(window)
+            for out, (rc, _, _) in zip(outs, results):
+                difference = compare_trees(tree, os.path.join(out, tree.lstrip("/")))
+                if rc != 0 or difference:
+                    failures.append("burst client %s (%s): exit status %d, %s" % (out, name, rc, difference))
+            shutil.rmtree(os.path.join(work, "burst-out"), ignore_errors=True)
+            latencies = sorted(seconds for _, seconds, _ in results)
+            with open(log_path, errors="replace") as f:
+                sizes = pool_sizes(f.read())
+            # The size when the burst arrived and every size it grew to
+            before = [n for t, n, _ in sizes if t < window[0]][-1:] or [int(server_options[1])]
+            peak = max(before + [n for t, n, _ in sizes if window[0] <= t <= window[1]])
+            print("%12s %6d %9.2f %9.2f %9.2f %9.2f %11d" % (name, burst + 1, end - start,
+                  latencies[len(latencies) // 2], latencies[len(latencies) * 9 // 10], latencies[-1], peak))
+        log = server.stop()
+
+        # Pool size over time: every resize of the elastic pool
+        if len(server_options) > 2:
+            print("  pool size over time (%s):" % name)
+            for t, n, reason in pool_sizes(log):
+                burst = [i + 1 for i, (a, b) in enumerate(windows) if a <= t <= b]
+                print("  %8.2fs %3d workers  %s%s" % (t, n, reason, "  (burst %d)" % burst[0] if burst else ""))
+    return failures
+
+
+def large_file(args, work, rng):
+    """Throughput of one large file sent with the read loop (which drops the sent pages) and with mmap,
+    from a cold and a warm page cache, and how much of the file is left in the page cache."""
+    binary = "-tsan" if args.tsan else ""
+    server_bin = os.path.join(REPO, "bin", "dataServer" + binary)
+    client_bin = os.path.join(REPO, "bin", "remoteClient" + binary)
+    tree = os.path.join(work, "large")
+    os.makedirs(tree)
+    path = os.path.join(tree, "large.bin")
+    with open(path, "wb") as f:
+        chunk = rng.randbytes(1 << 20)
+        for _ in range(args.large_mb):
+            f.write(chunk)
+    size = os.path.getsize(path)
+    failures = []
+    print("large file: %d MB" % (size >> 20))
+    print("%6s %10s %6s %9s %9s %11s %14s %13s" % ("send", "checksums", "cache", "seconds", "MB/s", "server CPU",
+                                                  "source cached", "clone cached"))
+    for mode, server_options in (("read", []), ("mmap", ["-m"])):
+        server = Server(server_bin, ["-s", "1", "-q", "4", "-b", "65536"] + server_options,
+                        os.path.join(work, "large-%s.log" % mode), args.tsan)
+        for options in ([], ["-c"]):
+            for cached in (False, True):
+                out = os.path.join(work, "large-out")
+                set_cached(path, cached)
+                cpu = server.cpu_seconds()
+                rc, seconds, _ = run_client(client_command(client_bin, ("127.0.0.1", server.port), tree, out, options),
+                                            args.timeout)
+                cpu = server.cpu_seconds() - cpu
+                clone = os.path.join(out, tree.lstrip("/"))
+                left = cached_fraction(path)
+                clone_left = cached_fraction(os.path.join(clone, "large.bin")) if rc == 0 else 0
+                print("%6s %10s %6s %9.2f %9.1f %10.2fs %13.0f%% %12.0f%%" % (mode, "yes" if options else "no",
+                      "warm" if cached else "cold", seconds, size / seconds / 1e6, cpu, left * 100, clone_left * 100))
+                difference = compare_trees(tree, clone)
+                if rc != 0 or difference:
+                    failures.append("large file (%s %s): exit status %d, %s" % (mode, " ".join(options), rc, difference))
+                shutil.rmtree(out, ignore_errors=True)
+        server.stop()
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--mode", choices=["stress", "compression", "bursts", "largefile"], default="stress",
+                        help="stress run and scaling curves, or one of the benchmarks")
+    parser.add_argument("--rates", default="1,4,16,0", help="link speeds (MB/s) of the compression benchmark, 0: unlimited")
+    parser.add_argument("--compression-kb", type=int, default=2048, help="largest file of the compression trees")
+    parser.add_argument("--bursts", type=int, default=3, help="bursts of the bursts benchmark")
+    parser.add_argument("--burst-clients", type=int, default=32, help="clients of every burst")
+    parser.add_argument("--burst-gap", type=float, default=8, help="seconds between bursts (the idle timeout is 5)")
+    parser.add_argument("--burst-pool", type=int, default=8, help="maximum pool size of the bursts benchmark")
+    parser.add_argument("--large-mb", type=int, default=1024, help="size of the file of the largefile benchmark")
+    parser.add_argument("--clients", type=int, default=200, help="concurrent clients of the stress run")
+    parser.add_argument("--seed", type=int, default=None, help="seed of the random trees and clients")
+    parser.add_argument("--tsan", action="store_true", help="run the ThreadSanitizer builds")
+    parser.add_argument("--scaling", default="1,2,4,8,16,32,64", help="client counts of the scaling curves")
+    parser.add_argument("--pools", default="1,2,4", help="pool sizes (-s) of the scaling curves")
+    parser.add_argument("--no-scaling", action="store_true", help="skip the scaling curves")
+    parser.add_argument("--timeout", type=int, default=600, help="seconds a client may take")
+    parser.add_argument("--keep", action="store_true", help="keep the trees, clones and server logs")
+    args = parser.parse_args()
+
+    seed = args.seed if args.seed is not None else random.randrange(1 << 30)
+    rng = random.Random(seed)
+    work = tempfile.mkdtemp(prefix="dataServer-stress-")
+    os.chmod(work, 0o755)       # the re-clones run as nobody
+    print("seed %d, work directory %s" % (seed, work))
+    if args.mode == "compression":
+        failures = compression(args, work, rng)
+    elif args.mode == "bursts":
+        failures = bursts(args, work, rng)
+    elif args.mode == "largefile":
+        failures = large_file(args, work, rng)
+    else:
+        trees = []
+        for i in range(8):
+            tree = os.path.join(work, "trees", "t%d" % i)
+            make_tree(tree, rng, rng.randint(5, 120), 1024 * 1024)
+            trees.append(tree)
+        failures = stress(args, work, trees, rng)
+        if not args.no_scaling:
+            failures += scaling(args, work, rng)
+
+    for failure in failures:
+        print("FAIL: " + failure)
+    if failures:
+        print("%d failures (seed %d, work directory %s kept)" % (len(failures), seed, work))
+        sys.exit(1)
+    if not args.keep:
+        shutil.rmtree(work, ignore_errors=True)
+    print("OK")
+
+
+if __name__ == "__main__":
+    main()